@@ -1,7 +1,9 @@
 // Buffer cache.
 //
-// The buffer cache is a linked list of buf structures holding
-// cached copies of disk block contents.  Caching disk blocks
+// The buffer cache is a hash table of buf structures holding
+// cached copies of disk block contents, with one lock per
+// hash bucket so that lookups of different blocks don't
+// contend.  Caching disk blocks
 // in memory reduces the number of disk reads and also provides
 // a synchronization point for disk blocks used by multiple processes.
 //
@@ -12,6 +14,16 @@
 // * Do not use the buffer after calling brelse.
 // * Only one process at a time can use a buffer,
 //     so do not keep them longer than necessary.
+// * To keep several disk requests in flight, call bwrite_start
+//     on each buffer, then bwait on each before brelse.
+//     bwrite_startv does the same for an array of buffers, and
+//     writes runs of consecutive blocks in single disk requests.
+// * breadahead starts reading blocks that will be needed soon,
+//     without waiting for them.
+// * File data isn't logged: bdirty marks a buffer whose contents
+//     are newer than the disk, and the flusher thread writes
+//     dirty buffers back in batches, every FLUSHTICKS ticks or
+//     when too many are dirty. Dirty buffers aren't recycled.
 
 
 #include "types.h"
@@ -22,70 +34,207 @@
 #include "defs.h"
 #include "fs.h"
 #include "buf.h"
+#include "kstat.h"
+
+#define NBUCKET 13
+#define BHASH(dev, blockno) (((dev) * 31 + (blockno)) % NBUCKET)
 
 struct {
+  // held while recycling a buffer, so that only one process
+  // at a time moves buffers between buckets.
   struct spinlock lock;
   struct buf buf[NBUF];
 
-  // Linked list of all buffers, through prev/next.
-  // Sorted by how recently the buffer was used.
-  // head.next is most recent, head.prev is least.
-  struct buf head;
+  // Hash table of cached blocks, keyed by (dev, blockno).
+  // Each bucket is a list of buffers, through prev/next,
+  // protected by the bucket's lock.
+  struct {
+    struct spinlock lock;
+    struct buf head;
+  } bucket[NBUCKET];
+
+  // bread() calls that found the block cached (perhaps
+  // by read-ahead) or had to wait for the disk, and
+  // blocks read ahead. Updated atomically, without a lock.
+  uint64 nhit;
+  uint64 nmiss;
+  uint64 nahead;
+
+  // protected by lock: the number of dirty buffers, and
+  // whether the flusher should write them now. Sleepers on
+  // &ndirty are woken when it goes down; the flusher sleeps
+  // on &flushnow.
+  int ndirty;
+  int flushnow;
+
+  // held by bflush(), which sorts the buffers it writes
+  // in flushbuf[].
+  struct sleeplock flushlock;
+  struct buf *flushbuf[NBUF];
 } bcache;
 
+// Processes wait in bthrottle() while this many buffers are
+// dirty, so that the rest of the cache stays usable.
+#define MAXDIRTY (NBUF/4)
+
+// Ask the flusher to write back dirty buffers now.
+// Caller holds bcache.lock.
+static void
+kickflusher(void)
+{
+  bcache.flushnow = 1;
+  wakeup(&bcache.flushnow);
+}
+
 void
 binit(void)
 {
   struct buf *b;
+  int i;
 
   initlock(&bcache.lock, "bcache");
+  initsleeplock(&bcache.flushlock, "bflush");
+  for(i = 0; i < NBUCKET; i++){
+    initlock(&bcache.bucket[i].lock, "bcache.bucket");
+    bcache.bucket[i].head.prev = &bcache.bucket[i].head;
+    bcache.bucket[i].head.next = &bcache.bucket[i].head;
+  }
 
-  // Create linked list of buffers
-  bcache.head.prev = &bcache.head;
-  bcache.head.next = &bcache.head;
+  // Create linked list of buffers, all in bucket 0 to start.
   for(b = bcache.buf; b < bcache.buf+NBUF; b++){
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
+    b->next = bcache.bucket[0].head.next;
+    b->prev = &bcache.bucket[0].head;
     initsleeplock(&b->lock, "buffer");
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
+    bcache.bucket[0].head.next->prev = b;
+    bcache.bucket[0].head.next = b;
   }
 }
 
-// Look through buffer cache for block on device dev.
-// If not found, allocate a buffer.
-// In either case, return locked buffer.
+// Look for block blockno on device dev in bucket h.
+// If found, take a reference to it.
+// Caller must hold the bucket's lock.
 static struct buf*
-bget(uint dev, uint blockno)
+bfind(int h, uint dev, uint blockno)
 {
   struct buf *b;
 
-  acquire(&bcache.lock);
-
-  // Is the block already cached?
-  for(b = bcache.head.next; b != &bcache.head; b = b->next){
+  for(b = bcache.bucket[h].head.next; b != &bcache.bucket[h].head; b = b->next){
     if(b->dev == dev && b->blockno == blockno){
       b->refcnt++;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
       return b;
     }
   }
+  return 0;
+}
+
+// Look through buffer cache for block on device dev.
+// If not found, allocate a buffer.
+// In either case, return locked buffer.
+// For read-ahead (ahead != 0), return 0 instead if the block
+// is already cached or there is no buffer to spare, so that
+// the caller never waits for another process's buffer.
+static struct buf*
+bget(uint dev, uint blockno, int ahead)
+{
+  struct buf *b, *victim;
+  int h, i, vh;
+
+  h = BHASH(dev, blockno);
+
+  // Is the block already cached?
+  acquire(&bcache.bucket[h].lock);
+  b = bfind(h, dev, blockno);
+  if(b && ahead)
+    b->refcnt--;
+  release(&bcache.bucket[h].lock);
+  if(b && ahead)
+    return 0;
+  if(b){
+    acquiresleep(&b->lock);
+    bwait(b);
+    return b;
+  }
 
   // Not cached.
-  // Recycle the least recently used (LRU) unused buffer.
-  for(b = bcache.head.prev; b != &bcache.head; b = b->prev){
-    if(b->refcnt == 0) {
-      b->dev = dev;
-      b->blockno = blockno;
-      b->valid = 0;
-      b->refcnt = 1;
-      release(&bcache.lock);
-      acquiresleep(&b->lock);
-      return b;
+  // Only one process at a time may recycle a buffer, so check
+  // again in case another process cached the block meanwhile.
+  acquire(&bcache.lock);
+recheck:
+  acquire(&bcache.bucket[h].lock);
+  b = bfind(h, dev, blockno);
+  if(b && ahead)
+    b->refcnt--;
+  release(&bcache.bucket[h].lock);
+  if(b && ahead){
+    release(&bcache.lock);
+    return 0;
+  }
+  if(b){
+    release(&bcache.lock);
+    acquiresleep(&b->lock);
+    bwait(b);
+    return b;
+  }
+
+  // Recycle the least recently used (LRU) unused clean buffer
+  // that the disk is not reading or writing.
+  // Keep holding the lock of the bucket that contains the
+  // best candidate so far, so that it can't be taken.
+  // Holding bcache.lock means no other process holds more
+  // than one bucket lock, so this can't deadlock.
+  victim = 0;
+  vh = -1;
+  for(i = 0; i < NBUCKET; i++){
+    int better = 0;
+    acquire(&bcache.bucket[i].lock);
+    for(b = bcache.bucket[i].head.next; b != &bcache.bucket[i].head; b = b->next){
+      if(b->refcnt == 0 && b->disk == 0 && b->dirty == 0 &&
+         (victim == 0 || b->lastuse < victim->lastuse)){
+        victim = b;
+        better = 1;
+      }
     }
+    if(better){
+      if(vh >= 0)
+        release(&bcache.bucket[vh].lock);
+      vh = i;
+    } else {
+      release(&bcache.bucket[i].lock);
+    }
+  }
+  if(victim == 0 && ahead){
+    release(&bcache.lock);
+    return 0;
   }
-  panic("bget: no buffers");
+  if(victim == 0 && bcache.ndirty > 0){
+    // wait for the flusher to clean some.
+    kickflusher();
+    sleep(&bcache.ndirty, &bcache.lock);
+    goto recheck;
+  }
+  if(victim == 0)
+    panic("bget: no buffers");
+
+  // Take the victim out of its bucket.
+  victim->next->prev = victim->prev;
+  victim->prev->next = victim->next;
+  victim->dev = dev;
+  victim->blockno = blockno;
+  victim->valid = 0;
+  victim->refcnt = 1;
+  release(&bcache.bucket[vh].lock);
+
+  // And put it in the bucket for its new block.
+  acquire(&bcache.bucket[h].lock);
+  victim->next = bcache.bucket[h].head.next;
+  victim->prev = &bcache.bucket[h].head;
+  bcache.bucket[h].head.next->prev = victim;
+  bcache.bucket[h].head.next = victim;
+  release(&bcache.bucket[h].lock);
+
+  release(&bcache.lock);
+  acquiresleep(&victim->lock);
+  return victim;
 }
 
 // Return a locked buf with the contents of the indicated block.
@@ -94,14 +243,30 @@ bread(uint dev, uint blockno)
 {
   struct buf *b;
 
-  b = bget(dev, blockno);
+  b = bget(dev, blockno, 0);
   if(!b->valid) {
+    __sync_fetch_and_add(&bcache.nmiss, 1);
     virtio_disk_rw(b, 0);
     b->valid = 1;
+  } else {
+    __sync_fetch_and_add(&bcache.nhit, 1);
   }
   return b;
 }
 
+// Return a locked buf for the indicated block, zeroed,
+// without reading the disk: for a newly allocated block.
+struct buf*
+bclear(uint dev, uint blockno)
+{
+  struct buf *b;
+
+  b = bget(dev, blockno, 0);
+  memset(b->data, 0, BSIZE);
+  b->valid = 1;
+  return b;
+}
+
 // Write b's contents to disk.  Must be locked.
 void
 bwrite(struct buf *b)
@@ -111,43 +276,303 @@ bwrite(struct buf *b)
   virtio_disk_rw(b, 1);
 }
 
+// Start writing b's contents to disk, without waiting.
+// Must be locked, and the caller must bwait(b) before
+// changing b->data or calling brelse(b).
+void
+bwrite_start(struct buf *b)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bwrite_start");
+  virtio_disk_start(b, 1);
+}
+
+// Start writing the n locked buffers in bs, like bwrite_start()
+// on each, but with each run of up to NCLUSTER consecutive
+// blocks in bs moved by a single disk request.
+void
+bwrite_startv(struct buf **bs, int n)
+{
+  int i, k;
+
+  for(i = 0; i < n; i++)
+    if(!holdingsleep(&bs[i]->lock))
+      panic("bwrite_startv");
+  for(i = 0; i < n; i += k){
+    for(k = 1; i + k < n && k < NCLUSTER; k++){
+      if(bs[i+k]->dev != bs[i]->dev ||
+         bs[i+k]->blockno != bs[i]->blockno + k)
+        break;
+    }
+    virtio_disk_startv(bs + i, k, 1);
+  }
+}
+
+// Mark b, which must be locked, as holding file data newer
+// than the disk, for the flusher to write back. new says b
+// is a block newly allocated in the open log transaction;
+// only commit() writes those, just before the transaction
+// commits, so that the file never shows the block's old
+// contents and the block is free on disk until then.
+void
+bdirty(struct buf *b, int new)
+{
+  if(!holdingsleep(&b->lock))
+    panic("bdirty");
+  acquire(&bcache.lock);
+  if(b->dirty == 0)
+    bcache.ndirty++;
+  if(new)
+    b->dirty = 2;
+  else if(b->dirty == 0)
+    b->dirty = 1;
+  release(&bcache.lock);
+}
+
+// Mark b clean. Caller holds bcache.lock.
+static void
+bclean(struct buf *b)
+{
+  if(b->dirty){
+    b->dirty = 0;
+    bcache.ndirty--;
+    wakeup(&bcache.ndirty);
+  }
+}
+
+// Block blockno has been freed: don't write back its data.
+void
+bforget(uint dev, uint blockno)
+{
+  struct buf *b;
+  int h;
+
+  h = BHASH(dev, blockno);
+  acquire(&bcache.lock);
+  acquire(&bcache.bucket[h].lock);
+  for(b = bcache.bucket[h].head.next; b != &bcache.bucket[h].head; b = b->next){
+    if(b->dev == dev && b->blockno == blockno)
+      bclean(b);
+  }
+  release(&bcache.bucket[h].lock);
+  release(&bcache.lock);
+}
+
+// Is b dirty, new or not as asked, and writable now? One
+// pinned by the log may be a block freed by a transaction
+// that hasn't been installed yet, which would overwrite the
+// data; it waits for the next flush, after the log has
+// unpinned it. Caller holds b's bucket lock.
+static int
+flushable(struct buf *b, int new)
+{
+  return b->pins == 0 && b->dirty == (new ? 2 : 1);
+}
+
+// Write back the dirty buffers of blocks that were on disk
+// already, or with new those of blocks newly allocated (see
+// bdirty()), in block order, so that runs of consecutive
+// blocks go to the disk as single requests. Returns how many
+// dirty buffers it had to leave for later because the log
+// held them. Locks buffers in block order, and the file
+// system never waits for a data block while holding another,
+// so this can't deadlock.
+int
+bflush(int new)
+{
+  struct buf **bs = bcache.flushbuf;
+  struct buf *b;
+  int h, i, j, n, m, left;
+
+  acquiresleep(&bcache.flushlock);
+
+  // Dirty buffers aren't recycled, so a buffer's block can't
+  // change while bcache.lock is held.
+  left = 0;
+  n = 0;
+  acquire(&bcache.lock);
+  for(b = bcache.buf; b < bcache.buf+NBUF; b++){
+    if(b->dirty == 0)
+      continue;
+    h = BHASH(b->dev, b->blockno);
+    acquire(&bcache.bucket[h].lock);
+    if(flushable(b, new)){
+      b->refcnt++;
+      for(j = n++; j > 0 && (bs[j-1]->dev > b->dev ||
+          (bs[j-1]->dev == b->dev && bs[j-1]->blockno > b->blockno)); j--)
+        bs[j] = bs[j-1];
+      bs[j] = b;
+    } else if(b->dirty && b->pins > 0){
+      left++;
+    }
+    release(&bcache.bucket[h].lock);
+  }
+  release(&bcache.lock);
+
+  // the buffers may have been cleaned, freed or pinned before
+  // we got their locks.
+  m = 0;
+  for(i = 0; i < n; i++){
+    b = bs[i];
+    acquiresleep(&b->lock);
+    h = BHASH(b->dev, b->blockno);
+    acquire(&bcache.bucket[h].lock);
+    if(flushable(b, new)){
+      bs[m++] = b;
+    } else {
+      if(b->dirty && b->pins > 0)
+        left++;
+      b = 0;
+    }
+    release(&bcache.bucket[h].lock);
+    if(b == 0)
+      brelse(bs[i]);
+  }
+
+  bwrite_startv(bs, m);
+  for(i = 0; i < m; i++)
+    bwait(bs[i]);
+  acquire(&bcache.lock);
+  for(i = 0; i < m; i++)
+    bclean(bs[i]);
+  release(&bcache.lock);
+  for(i = 0; i < m; i++)
+    brelse(bs[i]);
+
+  releasesleep(&bcache.flushlock);
+  return left;
+}
+
+// Wait while too many buffers are dirty. Called before
+// beginning a write, holding no locks. Those of new blocks
+// are cleaned only when their transaction commits, so the
+// caller mustn't be in one.
+void
+bthrottle(void)
+{
+  acquire(&bcache.lock);
+  while(bcache.ndirty >= MAXDIRTY){
+    kickflusher();
+    sleep(&bcache.ndirty, &bcache.lock);
+  }
+  release(&bcache.lock);
+}
+
+// The flusher kernel thread: write back dirty buffers of old
+// blocks every FLUSHTICKS ticks, or sooner if someone is
+// waiting for them. commit() writes those of new blocks.
+// flushnow is cleared before bflush() looks for dirty buffers,
+// so a request made while it runs causes another round.
+void
+bflusher(void)
+{
+  acquire(&bcache.lock);
+  for(;;){
+    while(!bcache.flushnow)
+      sleep(&bcache.flushnow, &bcache.lock);
+    bcache.flushnow = 0;
+    release(&bcache.lock);
+    bflush(0);
+    acquire(&bcache.lock);
+  }
+}
+
+// Called by clockintr() every FLUSHTICKS ticks.
+void
+bflushtick(void)
+{
+  acquire(&bcache.lock);
+  if(bcache.ndirty > 0)
+    kickflusher();
+  release(&bcache.lock);
+}
+
+// Wait for the disk to finish with b.
+void
+bwait(struct buf *b)
+{
+  if(b->disk)
+    virtio_disk_wait(b);
+}
+
+// Start reading those of the n blocks from blockno on that
+// aren't cached already, without waiting for them. Each run
+// of up to NCLUSTER uncached blocks is one disk request.
+// bget() waits for the read to finish before anyone
+// uses a buffer.
+void
+breadahead(uint dev, uint blockno, uint n)
+{
+  struct buf *bs[NCLUSTER], *b;
+  uint i;
+  int k;
+
+  k = 0;
+  for(i = 0; i <= n; i++){
+    b = 0;
+    if(i < n)
+      b = bget(dev, blockno + i, 1);
+    if(b)
+      bs[k++] = b;
+    if(k > 0 && (b == 0 || k == NCLUSTER)){
+      __sync_fetch_and_add(&bcache.nahead, k);
+      virtio_disk_startv(bs, k, 0);
+      while(k > 0){
+        b = bs[--k];
+        b->valid = 1;
+        brelse(b);
+      }
+    }
+  }
+}
+
+// Copy the buffer cache counters into st.
+void
+bstats(struct kstat *st)
+{
+  st->bhit = bcache.nhit;
+  st->bmiss = bcache.nmiss;
+  st->bahead = bcache.nahead;
+}
+
 // Release a locked buffer.
-// Move to the head of the most-recently-used list.
+// If no one else is using it, note the time for LRU recycling.
 void
 brelse(struct buf *b)
 {
+  int h;
+
   if(!holdingsleep(&b->lock))
     panic("brelse");
 
   releasesleep(&b->lock);
 
-  acquire(&bcache.lock);
+  h = BHASH(b->dev, b->blockno);
+  acquire(&bcache.bucket[h].lock);
   b->refcnt--;
   if (b->refcnt == 0) {
     // no one is waiting for it.
-    b->next->prev = b->prev;
-    b->prev->next = b->next;
-    b->next = bcache.head.next;
-    b->prev = &bcache.head;
-    bcache.head.next->prev = b;
-    bcache.head.next = b;
-  }
-  
-  release(&bcache.lock);
+    b->lastuse = ticks;
+  }
+  release(&bcache.bucket[h].lock);
 }
 
 void
 bpin(struct buf *b) {
-  acquire(&bcache.lock);
+  int h = BHASH(b->dev, b->blockno);
+
+  acquire(&bcache.bucket[h].lock);
   b->refcnt++;
-  release(&bcache.lock);
+  b->pins++;
+  release(&bcache.bucket[h].lock);
 }
 
 void
 bunpin(struct buf *b) {
-  acquire(&bcache.lock);
+  int h = BHASH(b->dev, b->blockno);
+
+  acquire(&bcache.bucket[h].lock);
   b->refcnt--;
-  release(&bcache.lock);
+  b->pins--;
+  release(&bcache.bucket[h].lock);
 }
-
-
@@ -1,11 +1,16 @@
 struct buf {
   int valid;   // has data been read from disk?
   int disk;    // does disk "own" buf?
+  int dirty;   // 1: file data not yet written to disk; 2: data of
+               //    a new block, which must reach disk before the
+               //    transaction allocating it commits
+  int pins;    // log transactions holding the buf
   uint dev;
   uint blockno;
   struct sleeplock lock;
   uint refcnt;
-  struct buf *prev; // LRU cache list
+  uint lastuse; // ticks when refcnt last dropped to 0, for LRU
+  struct buf *prev; // hash bucket list
   struct buf *next;
   uchar data[BSIZE];
 };
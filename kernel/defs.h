@@ -2,18 +2,32 @@ struct buf;
 struct context;
 struct file;
 struct inode;
+struct kstat;
 struct pipe;
 struct proc;
 struct spinlock;
 struct sleeplock;
 struct stat;
 struct superblock;
+struct vma;
 
 // bio.c
 void            binit(void);
 struct buf*     bread(uint, uint);
 void            brelse(struct buf*);
 void            bwrite(struct buf*);
+void            bwrite_start(struct buf*);
+void            bwait(struct buf*);
+void            bwrite_startv(struct buf**, int);
+struct buf*     bclear(uint, uint);
+void            bdirty(struct buf*, int);
+void            bforget(uint, uint);
+int             bflush(int);
+void            bthrottle(void);
+void            bflusher(void);
+void            bflushtick(void);
+void            breadahead(uint, uint, uint);
+void            bstats(struct kstat*);
 void            bpin(struct buf*);
 void            bunpin(struct buf*);
 
@@ -33,13 +47,17 @@ void            fileinit(void);
 int             fileread(struct file*, uint64, int n);
 int             filestat(struct file*, uint64 addr);
 int             filewrite(struct file*, uint64, int n);
+int             filesync(struct file*);
 
 // fs.c
 void            fsinit(int);
 int             dirlink(struct inode*, char*, uint);
 struct inode*   dirlookup(struct inode*, char*, uint*);
+void            dcacheforget(struct inode*, char*);
 struct inode*   ialloc(uint, short);
 struct inode*   idup(struct inode*);
+void            idenywrite(struct inode*);
+void            iallowwrite(struct inode*);
 void            iinit();
 void            ilock(struct inode*);
 void            iput(struct inode*);
@@ -50,6 +68,7 @@ int             namecmp(const char*, const char*);
 struct inode*   namei(char*);
 struct inode*   nameiparent(char*, char*);
 int             readi(struct inode*, int, uint64, uint, uint);
+void            ireadahead(struct inode*, uint, uint);
 void            stati(struct inode*, struct stat*);
 int             writei(struct inode*, int, uint64, uint, uint);
 void            itrunc(struct inode*);
@@ -63,12 +82,30 @@ void            ramdiskrw(struct buf*);
 void*           kalloc(void);
 void            kfree(void *);
 void            kinit(void);
+void            krefinc(void *);
+int             krefcnt(void *);
 
 // log.c
 void            initlog(int, struct superblock*);
 void            log_write(struct buf*);
 void            begin_op(void);
 void            end_op(void);
+void            log_sync(void);
+int             log_seq(void);
+int             log_done(void);
+
+// mmap.c
+void            mmapinit(void);
+uint64          mmap(uint64, int, int, struct file*, uint);
+int             munmap(uint64, uint64);
+void            munmapall(struct proc*);
+uint64          mmapbase(struct proc*);
+void            mmapprefault(uint64, uint64, int);
+struct vma*     vmafind(struct proc*, uint64);
+int             vmafault(struct proc*, uint64, int);
+int             vmacopy(struct proc*, struct proc*);
+void            pgupdate(struct inode*, uint, uint);
+void            pgdrop(struct inode*);
 
 // pipe.c
 int             pipealloc(struct file**, struct file**);
@@ -100,9 +137,11 @@ void            scheduler(void) __attribute__((noreturn));
 void            sched(void);
 void            sleep(void*, struct spinlock*);
 void            userinit(void);
+int             kthread(char*, void (*)(void));
 int             wait(uint64);
 void            wakeup(void*);
 void            yield(void);
+void            idlestats(struct kstat*);
 int             either_copyout(int user_dst, uint64 dst, void *src, uint64 len);
 int             either_copyin(void *dst, int user_src, uint64 src, uint64 len);
 void            procdump(void);
@@ -164,7 +203,11 @@ pagetable_t     uvmcreate(void);
 void            uvmfirst(pagetable_t, uchar *, uint);
 uint64          uvmalloc(pagetable_t, uint64, uint64, int);
 uint64          uvmdealloc(pagetable_t, uint64, uint64);
-int             uvmcopy(pagetable_t, pagetable_t, uint64);
+int             uvmcopy(pagetable_t, pagetable_t, uint64, uint64, int);
+uint64          vmfault(pagetable_t, uint64, int, int);
+int             vmfaultoom(pagetable_t, uint64, int, int);
+uint64          uvmsatp(struct proc*);
+void            asidretire(struct proc*);
 void            uvmfree(pagetable_t, uint64);
 void            uvmunmap(pagetable_t, uint64, uint64, int);
 void            uvmclear(pagetable_t, uint64);
@@ -183,7 +226,11 @@ void            plic_complete(int);
 // virtio_disk.c
 void            virtio_disk_init(void);
 void            virtio_disk_rw(struct buf *, int);
+void            virtio_disk_start(struct buf *, int);
+void            virtio_disk_startv(struct buf **, int, int);
+void            virtio_disk_wait(struct buf *);
 void            virtio_disk_intr(void);
+void            virtio_disk_stats(struct kstat*);
 
 // number of elements in fixed-size array
 #define NELEM(x) (sizeof(x)/sizeof((x)[0]))
@@ -3,9 +3,20 @@
 #include "memlayout.h"
 #include "riscv.h"
 #include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
 #include "proc.h"
 #include "defs.h"
 #include "elf.h"
+#include "fcntl.h"
+
+// Programs at least this big are paged in on demand: exec()
+// only records where each segment comes from in the file, and
+// vmfault() reads a page when the program first touches it.
+// Smaller ones are read in whole, which costs less than the
+// page faults.
+#define LAZYMIN (8*PGSIZE)
 
 static int loadseg(pde_t *, uint64, struct inode *, uint, uint);
 
@@ -19,18 +30,47 @@ int flags2perm(int flags)
     return perm;
 }
 
+static int flags2prot(int flags)
+{
+    int prot = PROT_READ;
+    if(flags & 0x1)
+      prot |= PROT_EXEC;
+    if(flags & 0x2)
+      prot |= PROT_WRITE;
+    return prot;
+}
+
+// Drop the inodes of the segments recorded for a failed exec.
+static void
+freesegs(struct vma *vma)
+{
+  struct vma *v;
+
+  for(v = vma; v < &vma[NVMA]; v++){
+    if(v->ip){
+      iallowwrite(v->ip);
+      begin_op();
+      iput(v->ip);
+      end_op();
+      v->ip = 0;
+    }
+  }
+}
+
 int
 exec(char *path, char **argv)
 {
   char *s, *last;
-  int i, off;
+  int i, off, nseg, lazy;
   uint64 argc, sz = 0, sp, ustack[MAXARG], stackbase;
+  struct vma vma[NVMA];
   struct elfhdr elf;
   struct inode *ip;
   struct proghdr ph;
   pagetable_t pagetable = 0, oldpagetable;
   struct proc *p = myproc();
 
+  memset(vma, 0, sizeof(vma));
   begin_op();
 
   if((ip = namei(path)) == 0){
@@ -49,6 +89,9 @@ exec(char *path, char **argv)
   if((pagetable = proc_pagetable(p)) == 0)
     goto bad;
 
+  nseg = 0;
+  lazy = ip->size >= LAZYMIN;
+
   // Load program into memory.
   for(i=0, off=elf.phoff; i<elf.phnum; i++, off+=sizeof(ph)){
     if(readi(ip, 0, (uint64)&ph, off, sizeof(ph)) != sizeof(ph))
@@ -61,6 +104,22 @@ exec(char *path, char **argv)
       goto bad;
     if(ph.vaddr % PGSIZE != 0)
       goto bad;
+    if(lazy && ph.off % PGSIZE == 0 && nseg < NVMA){
+      if(ph.vaddr + ph.memsz > sz)
+        sz = ph.vaddr + ph.memsz;
+      if(ph.memsz == 0)
+        continue;
+      vma[nseg].start = ph.vaddr;
+      vma[nseg].end = PGROUNDUP(ph.vaddr + ph.memsz);
+      vma[nseg].prot = flags2prot(ph.flags);
+      vma[nseg].flags = MAP_PRIVATE | VMA_IMAGE;
+      vma[nseg].off = ph.off;
+      vma[nseg].filesz = ph.filesz;
+      vma[nseg].ip = idup(ip);
+      idenywrite(ip);
+      nseg++;
+      continue;
+    }
     uint64 sz1;
     if((sz1 = uvmalloc(pagetable, sz, ph.vaddr + ph.memsz, flags2perm(ph.flags))) == 0)
       goto bad;
@@ -121,11 +180,14 @@ exec(char *path, char **argv)
   safestrcpy(p->name, last, sizeof(p->name));
     
   // Commit to the user image.
+  munmapall(p);
+  memmove(p->vma, vma, sizeof(vma));
   oldpagetable = p->pagetable;
   p->pagetable = pagetable;
   p->sz = sz;
   p->trapframe->epc = elf.entry;  // initial program counter = main
   p->trapframe->sp = sp; // initial stack pointer
+  asidretire(p);
   proc_freepagetable(oldpagetable, oldsz);
 
   return argc; // this ends up in a0, the first argument to main(argc, argv)
@@ -137,6 +199,7 @@ exec(char *path, char **argv)
     iunlockput(ip);
     end_op();
   }
+  freesegs(vma);
   return -1;
 }
 
@@ -13,6 +13,9 @@
 #include "stat.h"
 #include "proc.h"
 
+#define RAMIN 2       // initial read-ahead window, in blocks
+#define RAMAX NDISKQ  // largest read-ahead window
+
 struct devsw devsw[NDEV];
 struct {
   struct spinlock lock;
@@ -101,15 +104,70 @@ filestat(struct file *f, uint64 addr)
   return -1;
 }
 
+// Make f's data and metadata durable. Writes back all
+// dirty file data, not just f's, then waits for the log.
+// Buffers the log holds are written back once it lets
+// them go, so go around again until there are none.
+int
+filesync(struct file *f)
+{
+  int left;
+
+  if(f->type != FD_INODE)
+    return -1;
+  do {
+    left = bflush(0);
+    log_sync();
+  } while(left > 0);
+  return 0;
+}
+
+// After a read of f that started at off, keep a window of
+// the blocks that follow reading into the buffer cache if
+// f is being read sequentially. The window doubles with each
+// sequential read, from RAMIN up to RAMAX blocks, and
+// closes when the reader seeks elsewhere.
+// Caller must hold f->ip->lock.
+static void
+readahead(struct file *f, uint off)
+{
+  uint bn, end;
+
+  if(f->off == off)
+    return;
+
+  if(off != f->raoff){
+    f->rawin = 0;
+    f->ranext = 0;
+    f->raoff = f->off;
+    return;
+  }
+  f->raoff = f->off;
+  f->rawin = f->rawin ? 2 * f->rawin : RAMIN;
+  if(f->rawin > RAMAX)
+    f->rawin = RAMAX;
+
+  bn = f->off / BSIZE;
+  end = bn + f->rawin;
+  if(bn < f->ranext)
+    bn = f->ranext;
+  if(bn < end){
+    ireadahead(f->ip, bn, end - bn);
+    f->ranext = end;
+  }
+}
+
 // Read from file f.
 // addr is a user virtual address.
 int
 fileread(struct file *f, uint64 addr, int n)
 {
   int r = 0;
+  uint off;
 
   if(f->readable == 0)
     return -1;
+  mmapprefault(addr, n, 1);
 
   if(f->type == FD_PIPE){
     r = piperead(f->pipe, addr, n);
@@ -119,8 +177,10 @@ fileread(struct file *f, uint64 addr, int n)
     r = devsw[f->major].read(1, addr, n);
   } else if(f->type == FD_INODE){
     ilock(f->ip);
+    off = f->off;
     if((r = readi(f->ip, 1, addr, f->off, n)) > 0)
       f->off += r;
+    readahead(f, off);
     iunlock(f->ip);
   } else {
     panic("fileread");
@@ -138,6 +198,7 @@ filewrite(struct file *f, uint64 addr, int n)
 
   if(f->writable == 0)
     return -1;
+  mmapprefault(addr, n, 0);
 
   if(f->type == FD_PIPE){
     ret = pipewrite(f->pipe, addr, n);
@@ -147,18 +208,24 @@ filewrite(struct file *f, uint64 addr, int n)
     ret = devsw[f->major].write(1, addr, n);
   } else if(f->type == FD_INODE){
     // write a few blocks at a time to avoid exceeding
-    // the maximum log transaction size, including
-    // i-node, indirect block, allocation blocks,
-    // and 2 blocks of slop for non-aligned writes.
+    // the maximum log transaction size. A file's data isn't
+    // logged, but each block written may be new, and log its
+    // allocation block; so may a block of slop for non-aligned
+    // writes. Also logged: the i-node, and up to three map
+    // blocks (the double-indirect block and two blocks it
+    // points to, or the indirect block, the double-indirect
+    // block and one block it points to), of which two may be
+    // new, with allocation blocks of their own.
     // this really belongs lower down, since writei()
     // might be writing a device like the console.
-    int max = ((MAXOPBLOCKS-1-1-2) / 2) * BSIZE;
+    int max = (MAXOPBLOCKS-1-1-3-2) * BSIZE;
     int i = 0;
     while(i < n){
       int n1 = n - i;
       if(n1 > max)
         n1 = max;
 
+      bthrottle();
       begin_op();
       ilock(f->ip);
       if ((r = writei(f->ip, 1, addr + i, f->off, n1)) > 0)
@@ -6,6 +6,9 @@ struct file {
   struct pipe *pipe; // FD_PIPE
   struct inode *ip;  // FD_INODE and FD_DEVICE
   uint off;          // FD_INODE
+  uint raoff;        // FD_INODE: offset just past the last read
+  uint rawin;        // FD_INODE: read-ahead window, in blocks
+  uint ranext;       // FD_INODE: next block to read ahead
   short major;       // FD_DEVICE
 };
 
@@ -18,6 +21,15 @@ struct inode {
   uint dev;           // Device number
   uint inum;          // Inode number
   int ref;            // Reference count
+  int ntext;          // program image mappings; the file can't be
+                      // written while there are any. Protected by
+                      // itable.lock, and raised from 0 only with
+                      // ip->lock held too.
+  int npage;          // pages of the file in the page cache; see
+                      // mmap.c. Protected by pgcache.lock.
+  struct inode *hnext;  // next in itable hash chain
+  struct inode *lprev;  // LRU list of unreferenced inodes
+  struct inode *lnext;
   struct sleeplock lock; // protects everything below here
   int valid;          // inode has been read from disk?
 
@@ -26,7 +38,8 @@ struct inode {
   short minor;
   short nlink;
   uint size;
-  uint addrs[NDIRECT+1];
+  uint addrs[NDIRECT+2];
+  uint lastb;         // block last allocated for the inode, a hint
 };
 
 // map major device number to device functions.
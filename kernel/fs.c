@@ -37,49 +37,197 @@ readsb(int dev, struct superblock *sb)
   brelse(bp);
 }
 
+static void bpendinit(void);
+
 // Init fs
 void
 fsinit(int dev) {
   readsb(dev, &sb);
   if(sb.magic != FSMAGIC)
     panic("invalid file system");
+  if(sb.size > FSSIZE)
+    panic("fsinit: file system bigger than FSSIZE");
+  // unlink() of a big file logs a directory block, two
+  // inodes, and the bitmap blocks itrunc() frees its blocks
+  // in: at worst all of them.
+  if(3 + sb.size/BPB + 1 > MAXOPBLOCKS)
+    panic("fsinit: MAXOPBLOCKS too small to free a file");
+  bpendinit();
   initlog(dev, &sb);
+  if(kthread("flusher", bflusher) < 0)
+    panic("fsinit: flusher");
 }
 
-// Zero a block.
+// Zero a newly allocated block, through the log if it
+// will hold metadata; file data is written back later.
 static void
-bzero(int dev, int bno)
+bzero(int dev, int bno, int logged)
 {
   struct buf *bp;
 
-  bp = bread(dev, bno);
-  memset(bp->data, 0, BSIZE);
-  log_write(bp);
+  bp = bclear(dev, bno);
+  if(logged)
+    log_write(bp);
+  else
+    bdirty(bp, 1);
   brelse(bp);
 }
 
 // Blocks.
 
-// Allocate a zeroed disk block.
+// Hints for balloc(), so that it need not scan the bitmap
+// from the start. Races cost at most a longer scan.
+#define NBMAP 64
+
+struct {
+  uint rotor;         // where allocation without a goal starts
+  char full[NBMAP];   // bitmap block has no free bit?
+} bhint;
+
+// Blocks freed by log transactions that may not have committed
+// yet. They must not hold file data, which isn't logged, until
+// the free has committed: if the disk reached the data first, a
+// crash would leave it in a block the old owner still lists.
+// The open transaction and the committing one each have a slot;
+// a slot whose transaction has committed is free for reuse.
+// Bits for a bitmap block change with its buffer locked.
+#define NPEND ((FSSIZE + BPB - 1) / BPB)
+
+struct {
+  struct spinlock lock;
+  struct {
+    int seq;          // the transaction, see log_seq()
+    uint64 bits[NPEND][BPB/64];
+  } slot[2];
+} bpend;
+
+// Number of trailing zero bits in x, which must not be 0.
+// Done by hand: the kernel isn't linked with libgcc.
+static int
+ctz64(uint64 x)
+{
+  int n = 0;
+
+  if((x & 0xFFFFFFFF) == 0){ n += 32; x >>= 32; }
+  if((x & 0xFFFF) == 0){ n += 16; x >>= 16; }
+  if((x & 0xFF) == 0){ n += 8; x >>= 8; }
+  if((x & 0xF) == 0){ n += 4; x >>= 4; }
+  if((x & 0x3) == 0){ n += 2; x >>= 2; }
+  if((x & 0x1) == 0)
+    n += 1;
+  return n;
+}
+
+// Return the first bit at or after bit bi that is clear in
+// bitmap block data and in busy[0] and busy[1], those that
+// aren't 0, or BPB if there is none.
+static int
+bscan(uchar *data, uint64 **busy, int bi)
+{
+  uint64 *w = (uint64*)data;
+  uint64 x;
+  int i;
+
+  for(i = bi / 64; i < BPB / 64; i++){
+    x = w[i];
+    if(busy[0])
+      x |= busy[0][i];
+    if(busy[1])
+      x |= busy[1][i];
+    if(i == bi / 64)
+      x |= (1UL << (bi % 64)) - 1;  // treat the bits below bi as set.
+    if(~x != 0)
+      return i * 64 + ctz64(~x);
+  }
+  return BPB;
+}
+
+static void
+bpendinit(void)
+{
+  initlock(&bpend.lock, "bpend");
+}
+
+// Point busy[] at the bits of bitmap block bb freed by
+// transactions that haven't committed, or at 0.
+static void
+bpending(uint bb, uint64 **busy)
+{
+  int done, k;
+
+  done = log_done();
+  acquire(&bpend.lock);
+  for(k = 0; k < 2; k++)
+    busy[k] = bpend.slot[k].seq > done ? bpend.slot[k].bits[bb] : 0;
+  release(&bpend.lock);
+}
+
+// Record that the open transaction frees block b.
+// Caller holds b's bitmap block.
+static void
+bpendfree(uint b)
+{
+  int seq, done, k;
+
+  seq = log_seq();
+  done = log_done();
+  acquire(&bpend.lock);
+  for(k = 0; k < 2 && bpend.slot[k].seq != seq; k++)
+    ;
+  if(k == 2){
+    // take the slot of a committed transaction.
+    for(k = 0; k < 2 && bpend.slot[k].seq > done; k++)
+      ;
+    if(k == 2)
+      panic("bpendfree");
+    memset(bpend.slot[k].bits, 0, sizeof(bpend.slot[k].bits));
+    bpend.slot[k].seq = seq;
+  }
+  bpend.slot[k].bits[b / BPB][b % BPB / 64] |= 1UL << (b % 64);
+  release(&bpend.lock);
+}
+
+// Allocate a zeroed disk block, the first free one at or
+// after goal if there is one, wrapping around the disk.
+// With goal 0, start after the last block allocated.
+// logged says whether to zero it through the log (see bzero);
+// a block for unlogged data must not be one whose free hasn't
+// committed (see bpend).
 // returns 0 if out of disk space.
 static uint
-balloc(uint dev)
+balloc(uint dev, uint goal, int logged)
 {
-  int b, bi, m;
+  uint b, nbmap, i, bb, bi;
+  uint64 *busy[2] = { 0, 0 };
   struct buf *bp;
 
-  bp = 0;
-  for(b = 0; b < sb.size; b += BPB){
-    bp = bread(dev, BBLOCK(b, sb));
-    for(bi = 0; bi < BPB && b + bi < sb.size; bi++){
-      m = 1 << (bi % 8);
-      if((bp->data[bi/8] & m) == 0){  // Is block free?
-        bp->data[bi/8] |= m;  // Mark block in use.
-        log_write(bp);
-        brelse(bp);
-        bzero(dev, b + bi);
-        return b + bi;
-      }
+  if(goal == 0 || goal >= sb.size)
+    goal = bhint.rotor < sb.size ? bhint.rotor : 0;
+  nbmap = (sb.size + BPB - 1) / BPB;
+
+  // the last pass looks at the bits of goal's bitmap
+  // block before goal.
+  for(i = 0; i <= nbmap; i++){
+    bb = (goal / BPB + i) % nbmap;
+    if(bb < NBMAP && bhint.full[bb])
+      continue;
+    bp = bread(dev, BBLOCK(bb * BPB, sb));
+    if(!logged)
+      bpending(bb, busy);
+    bi = bscan(bp->data, busy, i == 0 ? goal % BPB : 0);
+    b = bb * BPB + bi;
+    if(bi < BPB && b < sb.size){
+      bp->data[bi/8] |= 1 << (bi % 8);  // Mark block in use.
+      log_write(bp);
+      brelse(bp);
+      bhint.rotor = b + 1;
+      bzero(dev, b, logged);
+      return b;
+    }
+    if((i > 0 || goal % BPB == 0) && bb < NBMAP && !busy[0] && !busy[1]){
+      // the whole block has no free bit; bfree() clears
+      // this with the block locked, as we set it.
+      bhint.full[bb] = 1;
     }
     brelse(bp);
   }
@@ -101,7 +249,11 @@ bfree(int dev, uint b)
     panic("freeing free block");
   bp->data[bi/8] &= ~m;
   log_write(bp);
+  bpendfree(b);
+  if(b / BPB < NBMAP)
+    bhint.full[b / BPB] = 0;
   brelse(bp);
+  bforget(dev, b);
 }
 
 // Inodes.
@@ -129,18 +281,21 @@ bfree(int dev, uint b)
 //   is non-zero. ialloc() allocates, and iput() frees if
 //   the reference and link counts have fallen to zero.
 //
-// * Referencing in table: an entry in the inode table
-//   is free if ip->ref is zero. Otherwise ip->ref tracks
-//   the number of in-memory pointers to the entry (open
-//   files and current directories). iget() finds or
-//   creates a table entry and increments its ref; iput()
-//   decrements ref.
+// * Referencing in table: ip->ref tracks the number of
+//   in-memory pointers to a table entry (open files and
+//   current directories). iget() finds or creates a table
+//   entry and increments its ref; iput() decrements ref.
+//   An entry whose ref has fallen to zero stays in the
+//   table, on an LRU list, until iget() needs it for
+//   another inode.
 //
 // * Valid: the information (type, size, &c) in an inode
 //   table entry is only correct when ip->valid is 1.
 //   ilock() reads the inode from
 //   the disk and sets ip->valid, while iput() clears
-//   ip->valid if ip->ref has fallen to zero.
+//   ip->valid when it frees the inode. An entry on the LRU
+//   list keeps ip->valid, so that iget() and ilock() of an
+//   inode used recently don't read the disk.
 //
 // * Locked: file system code may only examine and modify
 //   the information in an inode and its content if it
@@ -164,32 +319,51 @@ bfree(int dev, uint b)
 // have locked the inodes involved; this lets callers create
 // multi-step atomic operations.
 //
+// The table finds entries through a hash table indexed by
+// device and i-number. It starts empty and takes entries a
+// page at a time from kalloc(); once it has NINODE, iget()
+// reuses the least recently used entry with ip->ref zero
+// before it grows further.
+//
 // The itable.lock spin-lock protects the allocation of itable
 // entries. Since ip->ref indicates whether an entry is free,
 // and ip->dev and ip->inum indicate which i-node an entry
-// holds, one must hold itable.lock while using any of those fields.
+// holds, one must hold itable.lock while using any of those
+// fields, or the hash and LRU links.
 //
 // An ip->lock sleep-lock protects all ip-> fields other than ref,
 // dev, and inum.  One must hold ip->lock in order to
 // read or write that inode's ip->valid, ip->size, ip->type, &c.
 
+#define NIHASH 31
+#define IHASH(dev, inum) (((dev) * 31 + (inum)) % NIHASH)
+
 struct {
   struct spinlock lock;
-  struct inode inode[NINODE];
+  struct inode *head[NIHASH];  // hash chains, linked by hnext
+  struct inode *free;          // entries never used, linked by hnext
+  int n;                       // entries taken from kalloc()
+
+  // Entries with ref zero, linked by lprev and lnext.
+  // lru.lnext is the most recently used.
+  struct inode lru;
 } itable;
 
+static void dcacheinit(void);
+static void dcachepurge(struct inode*);
+
 void
 iinit()
 {
-  int i = 0;
-  
   initlock(&itable.lock, "itable");
-  for(i = 0; i < NINODE; i++) {
-    initsleeplock(&itable.inode[i].lock, "inode");
-  }
+  itable.lru.lprev = &itable.lru;
+  itable.lru.lnext = &itable.lru;
+  dcacheinit();
 }
 
 static struct inode* iget(uint dev, uint inum);
+static struct inode* inew(void);
+static void lruremove(struct inode*);
 
 // Allocate an inode on device dev.
 // Mark it as allocated by  giving it type type.
@@ -246,36 +420,81 @@ iupdate(struct inode *ip)
 static struct inode*
 iget(uint dev, uint inum)
 {
-  struct inode *ip, *empty;
+  struct inode *ip;
 
   acquire(&itable.lock);
 
   // Is the inode already in the table?
-  empty = 0;
-  for(ip = &itable.inode[0]; ip < &itable.inode[NINODE]; ip++){
-    if(ip->ref > 0 && ip->dev == dev && ip->inum == inum){
-      ip->ref++;
+  for(ip = itable.head[IHASH(dev, inum)]; ip; ip = ip->hnext){
+    if(ip->dev == dev && ip->inum == inum){
+      if(ip->ref++ == 0)
+        lruremove(ip);
       release(&itable.lock);
       return ip;
     }
-    if(empty == 0 && ip->ref == 0)    // Remember empty slot.
-      empty = ip;
   }
 
   // Recycle an inode entry.
-  if(empty == 0)
+  if((ip = inew()) == 0)
     panic("iget: no inodes");
 
-  ip = empty;
   ip->dev = dev;
   ip->inum = inum;
   ip->ref = 1;
   ip->valid = 0;
+  ip->lastb = 0;
+  ip->hnext = itable.head[IHASH(dev, inum)];
+  itable.head[IHASH(dev, inum)] = ip;
   release(&itable.lock);
 
   return ip;
 }
 
+// Take ip off the LRU list. itable.lock must be held.
+static void
+lruremove(struct inode *ip)
+{
+  ip->lprev->lnext = ip->lnext;
+  ip->lnext->lprev = ip->lprev;
+}
+
+// Return an unused table entry, off the hash table:
+// a new one while there are fewer than NINODE, else the
+// least recently used entry with ref zero, else a new one.
+// Returns 0 if there is none and no memory for more.
+// itable.lock must be held.
+static struct inode*
+inew(void)
+{
+  struct inode *ip, **pp;
+  char *mem;
+
+  if(itable.free == 0 && (itable.n < NINODE || itable.lru.lprev == &itable.lru)){
+    if((mem = kalloc()) != 0){
+      for(ip = (struct inode*)mem; ip + 1 <= (struct inode*)(mem + PGSIZE); ip++){
+        memset(ip, 0, sizeof(*ip));
+        initsleeplock(&ip->lock, "inode");
+        ip->hnext = itable.free;
+        itable.free = ip;
+        itable.n++;
+      }
+    }
+  }
+  if((ip = itable.free) != 0){
+    itable.free = ip->hnext;
+    return ip;
+  }
+
+  if((ip = itable.lru.lprev) == &itable.lru)
+    return 0;
+  lruremove(ip);
+  for(pp = &itable.head[IHASH(ip->dev, ip->inum)]; *pp != ip; pp = &(*pp)->hnext)
+    ;
+  *pp = ip->hnext;
+  pgdrop(ip);
+  return ip;
+}
+
 // Increment reference count for ip.
 // Returns ip to enable ip = idup(ip1) idiom.
 struct inode*
@@ -287,6 +506,30 @@ idup(struct inode *ip)
   return ip;
 }
 
+// A running program maps ip as its image (see exec()), and
+// pages it in from the file, which therefore must not change:
+// writei() refuses, and open() won't truncate it.
+// Caller must hold ip->lock unless ip->ntext is already
+// non-zero, as for a fork() child's copy of the mapping.
+void
+idenywrite(struct inode *ip)
+{
+  acquire(&itable.lock);
+  ip->ntext++;
+  release(&itable.lock);
+}
+
+// Undo idenywrite(), when a program image mapping goes away.
+void
+iallowwrite(struct inode *ip)
+{
+  acquire(&itable.lock);
+  if(ip->ntext < 1)
+    panic("iallowwrite");
+  ip->ntext--;
+  release(&itable.lock);
+}
+
 // Lock the given inode.
 // Reads the inode from disk if necessary.
 void
@@ -347,6 +590,8 @@ iput(struct inode *ip)
 
     release(&itable.lock);
 
+    if(ip->type == T_DIR)
+      dcachepurge(ip);
     itrunc(ip);
     ip->type = 0;
     iupdate(ip);
@@ -357,7 +602,18 @@ iput(struct inode *ip)
     acquire(&itable.lock);
   }
 
-  ip->ref--;
+  if(--ip->ref == 0){
+    // recently used, unless freed: then first to go.
+    if(ip->valid){
+      ip->lnext = itable.lru.lnext;
+      ip->lprev = &itable.lru;
+    } else {
+      ip->lnext = &itable.lru;
+      ip->lprev = itable.lru.lprev;
+    }
+    ip->lnext->lprev = ip;
+    ip->lprev->lnext = ip;
+  }
   release(&itable.lock);
 }
 
@@ -374,60 +630,151 @@ iunlockput(struct inode *ip)
 // The content (data) associated with each inode is stored
 // in blocks on the disk. The first NDIRECT block numbers
 // are listed in ip->addrs[].  The next NINDIRECT blocks are
-// listed in block ip->addrs[NDIRECT].
+// listed in block ip->addrs[NDIRECT]. The next NDINDIRECT
+// are listed in the NINDIRECT blocks whose numbers are
+// listed in block ip->addrs[NDIRECT+1].
 
-// Return the disk block address of the nth block in inode ip.
-// If there is no such block, bmap allocates one.
-// returns 0 if out of disk space.
+#define NRUN 16
+
+// Allocate a block for ip's data (data != 0) or block map,
+// right after the last one allocated for it if that one is
+// free, so that a file written sequentially lies in one run
+// on the disk. Only the data of regular files isn't logged.
+static uint
+inodeballoc(struct inode *ip, int data)
+{
+  uint b, goal;
+
+  goal = ip->lastb ? ip->lastb + 1 : 0;
+  if((b = balloc(ip->dev, goal, !data || ip->type != T_FILE)) != 0)
+    ip->lastb = b;
+  return b;
+}
+
+// Store in addrs the disk addresses of up to n blocks
+// listed in map block mb, from entry i on, allocating any
+// that are missing, as data blocks if data != 0.
+// Returns how many it stored, fewer than n at the end
+// of mb or if out of disk space.
 static uint
-bmap(struct inode *ip, uint bn)
+maprun(struct inode *ip, uint mb, uint i, uint *addrs, uint n, int data)
 {
-  uint addr, *a;
   struct buf *bp;
+  uint *a, k;
+  int dirty = 0;
+
+  bp = bread(ip->dev, mb);
+  a = (uint*)bp->data;
+  for(k = 0; k < n && i + k < NINDIRECT; k++){
+    if(a[i+k] == 0){
+      if((a[i+k] = inodeballoc(ip, data)) == 0)
+        break;
+      dirty = 1;
+    }
+    addrs[k] = a[i+k];
+  }
+  if(dirty)
+    log_write(bp);
+  brelse(bp);
+  return k;
+}
+
+// Return the address of the block in *slot, one of
+// ip->addrs[], allocating it if necessary, as a data
+// block if data != 0.
+// returns 0 if out of disk space.
+static uint
+mapslot(struct inode *ip, uint *slot, int data)
+{
+  if(*slot == 0)
+    *slot = inodeballoc(ip, data);
+  return *slot;
+}
+
+// Store in addrs the disk addresses of up to n consecutive
+// blocks of inode ip, starting with the bnth, allocating
+// any that don't exist yet. Stops at the end of the direct
+// blocks or of an indirect block, so that a run costs at
+// most two map block reads however long it is.
+// Returns how many it stored: 0 if out of disk space.
+static uint
+bmaprun(struct inode *ip, uint bn, uint *addrs, uint n)
+{
+  uint k, mb;
 
   if(bn < NDIRECT){
-    if((addr = ip->addrs[bn]) == 0){
-      addr = balloc(ip->dev);
-      if(addr == 0)
-        return 0;
-      ip->addrs[bn] = addr;
+    for(k = 0; k < n && bn + k < NDIRECT; k++){
+      if(mapslot(ip, &ip->addrs[bn+k], 1) == 0)
+        break;
+      addrs[k] = ip->addrs[bn+k];
     }
-    return addr;
+    return k;
   }
   bn -= NDIRECT;
 
   if(bn < NINDIRECT){
-    // Load indirect block, allocating if necessary.
-    if((addr = ip->addrs[NDIRECT]) == 0){
-      addr = balloc(ip->dev);
-      if(addr == 0)
-        return 0;
-      ip->addrs[NDIRECT] = addr;
-    }
-    bp = bread(ip->dev, addr);
-    a = (uint*)bp->data;
-    if((addr = a[bn]) == 0){
-      addr = balloc(ip->dev);
-      if(addr){
-        a[bn] = addr;
-        log_write(bp);
-      }
-    }
-    brelse(bp);
-    return addr;
+    if((mb = mapslot(ip, &ip->addrs[NDIRECT], 0)) == 0)
+      return 0;
+    return maprun(ip, mb, bn, addrs, n, 1);
+  }
+  bn -= NINDIRECT;
+
+  if(bn < NDINDIRECT){
+    if((mb = mapslot(ip, &ip->addrs[NDIRECT+1], 0)) == 0)
+      return 0;
+    if(maprun(ip, mb, bn / NINDIRECT, &mb, 1, 0) == 0)
+      return 0;
+    return maprun(ip, mb, bn % NINDIRECT, addrs, n, 1);
   }
 
   panic("bmap: out of range");
 }
 
+// Number of blocks spanned by the n bytes at off, but at
+// most NRUN, the longest run readi() and writei() map at once.
+static uint
+runlen(uint off, uint n)
+{
+  uint nb = (off + n - 1) / BSIZE - off / BSIZE + 1;
+
+  return nb < NRUN ? nb : NRUN;
+}
+
+// Free the blocks listed in map block mb, and mb itself;
+// depth 1 if they are themselves map blocks.
+static void
+freemap(struct inode *ip, uint mb, int depth)
+{
+  struct buf *bp;
+  uint *a;
+  int j;
+
+  bp = bread(ip->dev, mb);
+  a = (uint*)bp->data;
+  for(j = 0; j < NINDIRECT; j++){
+    if(a[j] == 0)
+      continue;
+    if(depth > 0)
+      freemap(ip, a[j], depth - 1);
+    else
+      bfree(ip->dev, a[j]);
+  }
+  brelse(bp);
+  bfree(ip->dev, mb);
+}
+
 // Truncate inode (discard contents).
+// Logs only ip's inode block and the bitmap blocks, since
+// the map blocks are freed whole; fsinit() checks that all
+// the bitmap blocks fit in one FS operation.
 // Caller must hold ip->lock.
 void
 itrunc(struct inode *ip)
 {
-  int i, j;
-  struct buf *bp;
-  uint *a;
+  int i;
+
+  if(ip->ntext > 0)
+    panic("itrunc: program image");
 
   for(i = 0; i < NDIRECT; i++){
     if(ip->addrs[i]){
@@ -437,19 +784,18 @@ itrunc(struct inode *ip)
   }
 
   if(ip->addrs[NDIRECT]){
-    bp = bread(ip->dev, ip->addrs[NDIRECT]);
-    a = (uint*)bp->data;
-    for(j = 0; j < NINDIRECT; j++){
-      if(a[j])
-        bfree(ip->dev, a[j]);
-    }
-    brelse(bp);
-    bfree(ip->dev, ip->addrs[NDIRECT]);
+    freemap(ip, ip->addrs[NDIRECT], 0);
     ip->addrs[NDIRECT] = 0;
   }
 
+  if(ip->addrs[NDIRECT+1]){
+    freemap(ip, ip->addrs[NDIRECT+1], 1);
+    ip->addrs[NDIRECT+1] = 0;
+  }
+
   ip->size = 0;
   iupdate(ip);
+  pgdrop(ip);
 }
 
 // Copy stat information from inode.
@@ -471,7 +817,7 @@ stati(struct inode *ip, struct stat *st)
 int
 readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 {
-  uint tot, m;
+  uint tot, m, addrs[NRUN], na, ai;
   struct buf *bp;
 
   if(off > ip->size || off + n < off)
@@ -479,11 +825,20 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
   if(off + n > ip->size)
     n = ip->size - off;
 
+  // Read all the blocks of a multi-block request at once,
+  // in as few disk requests as their layout allows.
+  if(n > 0 && off/BSIZE != (off+n-1)/BSIZE)
+    ireadahead(ip, off/BSIZE, (off+n-1)/BSIZE - off/BSIZE + 1);
+
+  na = ai = 0;
   for(tot=0; tot<n; tot+=m, off+=m, dst+=m){
-    uint addr = bmap(ip, off/BSIZE);
-    if(addr == 0)
-      break;
-    bp = bread(ip->dev, addr);
+    if(ai == na){
+      na = bmaprun(ip, off/BSIZE, addrs, runlen(off, n - tot));
+      ai = 0;
+      if(na == 0)
+        break;
+    }
+    bp = bread(ip->dev, addrs[ai++]);
     m = min(n - tot, BSIZE - off%BSIZE);
     if(either_copyout(user_dst, dst, bp->data + (off % BSIZE), m) == -1) {
       brelse(bp);
@@ -495,8 +850,42 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
   return tot;
 }
 
+// Start reading up to n blocks of ip, beginning with
+// file block bn, into the buffer cache without waiting
+// for them. Blocks consecutive on the disk are read together.
+// Stops at the end of the file, and after NDISKQ blocks
+// so as not to monopolize the disk.
+// Caller must hold ip->lock.
+void
+ireadahead(struct inode *ip, uint bn, uint n)
+{
+  uint addrs[NDISKQ], nblocks, na, i, k;
+
+  nblocks = (ip->size + BSIZE - 1) / BSIZE;
+  if(n > NDISKQ)
+    n = NDISKQ;
+  if(bn >= nblocks)
+    return;
+  if(n > nblocks - bn)
+    n = nblocks - bn;
+  while(n > 0){
+    if((na = bmaprun(ip, bn, addrs, n)) == 0)
+      break;
+    for(i = 0; i < na; i += k){
+      for(k = 1; i + k < na && addrs[i+k] == addrs[i] + k; k++)
+        ;
+      breadahead(ip->dev, addrs[i], k);
+    }
+    bn += na;
+    n -= na;
+  }
+}
+
 // Write data to inode.
 // Caller must hold ip->lock.
+// A regular file's data isn't logged: it is left dirty in the
+// buffer cache, for the flusher or fsync() to write back.
+// Fails if a running program pages its image from ip.
 // If user_src==1, then src is a user virtual address;
 // otherwise, src is a kernel address.
 // Returns the number of bytes successfully written.
@@ -505,33 +894,43 @@ readi(struct inode *ip, int user_dst, uint64 dst, uint off, uint n)
 int
 writei(struct inode *ip, int user_src, uint64 src, uint off, uint n)
 {
-  uint tot, m;
+  uint tot, m, addrs[NRUN], na, ai;
   struct buf *bp;
 
+  if(ip->ntext > 0)
+    return -1;
   if(off > ip->size || off + n < off)
     return -1;
   if(off + n > MAXFILE*BSIZE)
     return -1;
 
+  na = ai = 0;
   for(tot=0; tot<n; tot+=m, off+=m, src+=m){
-    uint addr = bmap(ip, off/BSIZE);
-    if(addr == 0)
-      break;
-    bp = bread(ip->dev, addr);
+    if(ai == na){
+      na = bmaprun(ip, off/BSIZE, addrs, runlen(off, n - tot));
+      ai = 0;
+      if(na == 0)
+        break;
+    }
+    bp = bread(ip->dev, addrs[ai++]);
     m = min(n - tot, BSIZE - off%BSIZE);
     if(either_copyin(bp->data + (off % BSIZE), user_src, src, m) == -1) {
       brelse(bp);
       break;
     }
-    log_write(bp);
+    if(ip->type == T_FILE)
+      bdirty(bp, 0);
+    else
+      log_write(bp);
     brelse(bp);
   }
 
   if(off > ip->size)
     ip->size = off;
+  pgupdate(ip, off - tot, tot);
 
   // write the i-node back to disk even if the size didn't change
-  // because the loop above might have called bmap() and added a new
+  // because the loop above might have called bmaprun() and added a new
   // block to ip->addrs[].
   iupdate(ip);
 
@@ -546,6 +945,155 @@ namecmp(const char *s, const char *t)
   return strncmp(s, t, DIRSIZ);
 }
 
+// Directory name cache.
+//
+// Remembers the outcome of recent dirlookup()s, hashed by
+// directory and name: the entry's i-number and offset, or
+// that there is no such name. dirlink() and unlinking a
+// name forget what the cache knows about it, with the
+// directory locked, as dirlookup() inserts.
+//
+// namex() consults the cache without locking directories,
+// and takes its reference to the named inode with
+// dcache.lock held, so that an unlink() racing with it
+// can't free the inode first.
+
+#define NDHASH 31
+
+struct dentry {
+  uint dev;
+  uint dinum;           // directory's i-number, 0 if unused
+  char name[DIRSIZ];
+  uint inum;            // 0 if the directory has no such name
+  uint off;             // byte offset of the dirent
+  struct dentry *next;  // next in hash chain
+};
+
+struct {
+  struct spinlock lock;
+  struct dentry ent[NDCACHE];
+  struct dentry *head[NDHASH];
+  int hand;             // next entry to reuse
+} dcache;
+
+static struct dentry**
+dhash(uint dev, uint dinum, char *name)
+{
+  uint h = dev * 31 + dinum;
+
+  for(int i = 0; i < DIRSIZ && name[i]; i++)
+    h = h * 31 + (uchar)name[i];
+  return &dcache.head[h % NDHASH];
+}
+
+static void
+dcacheinit(void)
+{
+  initlock(&dcache.lock, "dcache");
+}
+
+// Find the entry for name in directory dp.
+// dcache.lock must be held.
+static struct dentry*
+dfind(struct inode *dp, char *name)
+{
+  struct dentry *d;
+
+  for(d = *dhash(dp->dev, dp->inum, name); d; d = d->next)
+    if(d->dinum == dp->inum && d->dev == dp->dev && namecmp(d->name, name) == 0)
+      return d;
+  return 0;
+}
+
+// Take d off its hash chain. dcache.lock must be held.
+static void
+dremove(struct dentry *d)
+{
+  struct dentry **pp;
+
+  for(pp = dhash(d->dev, d->dinum, d->name); *pp; pp = &(*pp)->next){
+    if(*pp == d){
+      *pp = d->next;
+      break;
+    }
+  }
+  d->dinum = 0;
+}
+
+// Look name up in directory dp through the cache.
+// On a hit, return 1 and set *ipp to the named inode,
+// with a reference, or to 0 if dp has no such name, and
+// set *poff if asked. On a miss, return 0.
+static int
+dcachelookup(struct inode *dp, char *name, struct inode **ipp, uint *poff)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  if((d = dfind(dp, name)) == 0){
+    release(&dcache.lock);
+    return 0;
+  }
+  *ipp = d->inum ? iget(dp->dev, d->inum) : 0;
+  if(poff)
+    *poff = d->off;
+  release(&dcache.lock);
+  return 1;
+}
+
+// Remember that name in directory dp is inum, at off,
+// or that dp has no such name if inum is 0.
+// Caller must hold dp->lock.
+static void
+dcacheinsert(struct inode *dp, char *name, uint inum, uint off)
+{
+  struct dentry *d, **h;
+
+  acquire(&dcache.lock);
+  if((d = dfind(dp, name)) == 0){
+    d = &dcache.ent[dcache.hand];
+    dcache.hand = (dcache.hand + 1) % NDCACHE;
+    if(d->dinum)
+      dremove(d);
+    d->dev = dp->dev;
+    d->dinum = dp->inum;
+    strncpy(d->name, name, DIRSIZ);
+    h = dhash(d->dev, d->dinum, d->name);
+    d->next = *h;
+    *h = d;
+  }
+  d->inum = inum;
+  d->off = off;
+  release(&dcache.lock);
+}
+
+// Forget what the cache knows about name in directory dp,
+// which is changing. Caller must hold dp->lock.
+void
+dcacheforget(struct inode *dp, char *name)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  if((d = dfind(dp, name)) != 0)
+    dremove(d);
+  release(&dcache.lock);
+}
+
+// Directory dp is being freed, and its i-number may
+// name something else next; forget all its names.
+static void
+dcachepurge(struct inode *dp)
+{
+  struct dentry *d;
+
+  acquire(&dcache.lock);
+  for(d = dcache.ent; d < &dcache.ent[NDCACHE]; d++)
+    if(d->dinum == dp->inum && d->dev == dp->dev)
+      dremove(d);
+  release(&dcache.lock);
+}
+
 // Look for a directory entry in a directory.
 // If found, set *poff to byte offset of entry.
 struct inode*
@@ -553,10 +1101,14 @@ dirlookup(struct inode *dp, char *name, uint *poff)
 {
   uint off, inum;
   struct dirent de;
+  struct inode *ip;
 
   if(dp->type != T_DIR)
     panic("dirlookup not DIR");
 
+  if(dcachelookup(dp, name, &ip, poff))
+    return ip;
+
   for(off = 0; off < dp->size; off += sizeof(de)){
     if(readi(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
       panic("dirlookup read");
@@ -567,10 +1119,12 @@ dirlookup(struct inode *dp, char *name, uint *poff)
       if(poff)
         *poff = off;
       inum = de.inum;
+      dcacheinsert(dp, name, inum, off);
       return iget(dp->dev, inum);
     }
   }
 
+  dcacheinsert(dp, name, 0, 0);
   return 0;
 }
 
@@ -599,6 +1153,7 @@ dirlink(struct inode *dp, char *name, uint inum)
 
   strncpy(de.name, name, DIRSIZ);
   de.inum = inum;
+  dcacheforget(dp, name);
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     return -1;
 
@@ -659,6 +1214,15 @@ namex(char *path, int nameiparent, char *name)
     ip = idup(myproc()->cwd);
 
   while((path = skipelem(path, name)) != 0){
+    // the cache only has entries for directories, so
+    // a hit needs neither ip's lock nor its contents.
+    if(!(nameiparent && *path == '\0') && dcachelookup(ip, name, &next, 0)){
+      iput(ip);
+      if(next == 0)
+        return 0;
+      ip = next;
+      continue;
+    }
     ilock(ip);
     if(ip->type != T_DIR){
       iunlockput(ip);
@@ -1,6 +1,19 @@
 // Physical memory allocator, for user processes,
 // kernel stacks, page-table pages,
 // and pipe buffers. Allocates whole 4096-byte pages.
+//
+// Each CPU keeps a private cache of free pages so that
+// kalloc() and kfree() normally touch only that CPU's
+// list. Pages move between the per-CPU caches and a
+// shared pool in batches of KBATCH. A CPU whose cache
+// and the shared pool are both empty steals half of
+// another CPU's cache.
+//
+// Pages can be shared, e.g. by copy-on-write fork, so
+// each page has a reference count. kalloc() sets it to
+// one, krefinc() adds a reference, and kfree() only
+// puts the page back on a free list when the last
+// reference is dropped.
 
 #include "types.h"
 #include "param.h"
@@ -9,6 +22,12 @@
 #include "riscv.h"
 #include "defs.h"
 
+#define KBATCH  32          // pages moved to/from the shared pool at once
+#define KHIGH   (2*KBATCH)  // drain a CPU's cache above this many pages
+
+// index of physical page pa in kmem.ref[].
+#define PA2REF(pa) (((uint64)(pa) - KERNBASE) / PGSIZE)
+
 void freerange(void *pa_start, void *pa_end);
 
 extern char end[]; // first address after kernel.
@@ -18,15 +37,25 @@ struct run {
   struct run *next;
 };
 
-struct {
+struct kcache {
   struct spinlock lock;
   struct run *freelist;
+  int nfree;
+};
+
+struct {
+  struct spinlock lock;   // protects the shared pool
+  struct run *freelist;
+  struct kcache cpu[NCPU];
+  int ref[(PHYSTOP - KERNBASE) / PGSIZE]; // updated atomically
 } kmem;
 
 void
 kinit()
 {
   initlock(&kmem.lock, "kmem");
+  for(int i = 0; i < NCPU; i++)
+    initlock(&kmem.cpu[i].lock, "kcache");
   freerange(end, (void*)PHYSTOP);
 }
 
@@ -35,31 +64,121 @@ freerange(void *pa_start, void *pa_end)
 {
   char *p;
   p = (char*)PGROUNDUP((uint64)pa_start);
-  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE)
+  for(; p + PGSIZE <= (char*)pa_end; p += PGSIZE){
+    kmem.ref[PA2REF(p)] = 1;
     kfree(p);
+  }
+}
+
+// Detach up to n pages from the front of *list.
+// Returns the detached chain and sets *got to its length.
+static struct run*
+ksplit(struct run **list, int n, int *got)
+{
+  struct run *head, *r;
+  int i;
+
+  head = *list;
+  if(head == 0 || n <= 0){
+    *got = 0;
+    return 0;
+  }
+  r = head;
+  for(i = 1; i < n && r->next; i++)
+    r = r->next;
+  *list = r->next;
+  r->next = 0;
+  *got = i;
+  return head;
 }
 
-// Free the page of physical memory pointed at by pa,
-// which normally should have been returned by a
+// Find more free pages for CPU id, whose cache is empty.
+// Takes a batch from the shared pool, or else steals half
+// of some other CPU's cache. Returns one page and puts the
+// rest of what was found in CPU id's cache.
+// Never holds more than one allocator lock at a time.
+static struct run*
+krefill(int id)
+{
+  struct kcache *kc;
+  struct run *r, *tail;
+  int i, n;
+
+  acquire(&kmem.lock);
+  r = ksplit(&kmem.freelist, KBATCH, &n);
+  release(&kmem.lock);
+
+  for(i = 1; r == 0 && i < NCPU; i++){
+    kc = &kmem.cpu[(id + i) % NCPU];
+    acquire(&kc->lock);
+    r = ksplit(&kc->freelist, (kc->nfree + 1) / 2, &n);
+    kc->nfree -= n;
+    release(&kc->lock);
+  }
+
+  if(r == 0 || r->next == 0)
+    return r;
+
+  for(tail = r->next; tail->next; tail = tail->next)
+    ;
+  kc = &kmem.cpu[id];
+  acquire(&kc->lock);
+  tail->next = kc->freelist;
+  kc->freelist = r->next;
+  kc->nfree += n - 1;
+  release(&kc->lock);
+  return r;
+}
+
+// Drop a reference to the page of physical memory pointed
+// at by pa, which normally should have been returned by a
 // call to kalloc().  (The exception is when
 // initializing the allocator; see kinit above.)
+// The page is freed when its last reference goes away.
 void
 kfree(void *pa)
 {
-  struct run *r;
+  struct run *r, *chain, *tail;
+  struct kcache *kc;
+  int n;
 
   if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
     panic("kfree");
 
+  n = __sync_sub_and_fetch(&kmem.ref[PA2REF(pa)], 1);
+  if(n < 0)
+    panic("kfree: ref");
+  if(n > 0)
+    return;
+
   // Fill with junk to catch dangling refs.
   memset(pa, 1, PGSIZE);
 
   r = (struct run*)pa;
 
-  acquire(&kmem.lock);
-  r->next = kmem.freelist;
-  kmem.freelist = r;
-  release(&kmem.lock);
+  push_off();
+  kc = &kmem.cpu[cpuid()];
+  acquire(&kc->lock);
+  r->next = kc->freelist;
+  kc->freelist = r;
+  kc->nfree++;
+  chain = 0;
+  if(kc->nfree > KHIGH){
+    chain = ksplit(&kc->freelist, KBATCH, &n);
+    kc->nfree -= n;
+  }
+  release(&kc->lock);
+
+  if(chain){
+    // give a batch back to the shared pool.
+    for(tail = chain; tail->next; tail = tail->next)
+      ;
+    acquire(&kmem.lock);
+    tail->next = kmem.freelist;
+    kmem.freelist = chain;
+    release(&kmem.lock);
+  }
+  pop_off();
 }
 
 // Allocate one 4096-byte page of physical memory.
@@ -69,14 +188,43 @@ void *
 kalloc(void)
 {
   struct run *r;
+  struct kcache *kc;
+  int id;
 
-  acquire(&kmem.lock);
-  r = kmem.freelist;
-  if(r)
-    kmem.freelist = r->next;
-  release(&kmem.lock);
+  push_off();
+  id = cpuid();
+  kc = &kmem.cpu[id];
+  acquire(&kc->lock);
+  r = kc->freelist;
+  if(r){
+    kc->freelist = r->next;
+    kc->nfree--;
+  }
+  release(&kc->lock);
+  if(r == 0)
+    r = krefill(id);
+  pop_off();
 
-  if(r)
+  if(r){
+    kmem.ref[PA2REF(r)] = 1;
     memset((char*)r, 5, PGSIZE); // fill with junk
+  }
   return (void*)r;
 }
+
+// Add a reference to an allocated page.
+void
+krefinc(void *pa)
+{
+  if(((uint64)pa % PGSIZE) != 0 || (char*)pa < end || (uint64)pa >= PHYSTOP)
+    panic("krefinc");
+  if(__sync_fetch_and_add(&kmem.ref[PA2REF(pa)], 1) < 1)
+    panic("krefinc: free page");
+}
+
+// Return the number of references to an allocated page.
+int
+krefcnt(void *pa)
+{
+  return kmem.ref[PA2REF(pa)];
+}
@@ -0,0 +1,10 @@
+// Kernel statistics, returned by the kstat() system call.
+struct kstat {
+  uint64 bhit;   // bread() found the block in the buffer cache
+  uint64 bmiss;  // bread() had to read the block from disk
+  uint64 bahead; // blocks read ahead into the buffer cache
+  uint64 dreq;   // requests sent to the disk
+  uint64 dblocks; // blocks those requests read or wrote
+  uint64 time;   // CLINT time now, 10,000,000 units per second in qemu
+  uint64 idle[NCPU]; // time each hart has spent idle in wfi
+};
@@ -10,8 +10,8 @@
 // Simple logging that allows concurrent FS system calls.
 //
 // A log transaction contains the updates of multiple FS system
-// calls. The logging system only commits when there are
-// no FS system calls active. Thus there is never
+// calls. The logging system only closes a transaction when
+// there are no FS system calls active in it. Thus there is never
 // any reasoning required about whether a commit might
 // write an uncommitted system call's updates to disk.
 //
@@ -21,6 +21,12 @@
 // But if it thinks the log is close to running out, it
 // sleeps until the last outstanding end_op() commits.
 //
+// Transactions are double-buffered. When a transaction closes,
+// its blocks are copied out of the buffer cache, and new FS
+// system calls go on to accumulate the next transaction in the
+// cache while the copies are written to the log and installed.
+// So there is at most one transaction committing and one open.
+//
 // The log is a physical re-do log containing disk blocks.
 // The on-disk log format:
 //   header block, containing block #s for block A, B, C, ...
@@ -28,7 +34,19 @@
 //   block B
 //   block C
 //   ...
-// Log appends are synchronous.
+// Only metadata is logged. The data of regular files is written
+// back from the buffer cache (see bdirty()), except that blocks
+// newly allocated for it are written just before the transaction
+// that allocates them commits, so that a file doesn't show a
+// block's previous contents after a crash. Such a block is free
+// on disk until then: blocks whose free hasn't committed aren't
+// reused for file data (see balloc()). A crash may lose, or tear,
+// overwrites of a file's existing blocks that fsync() hasn't
+// waited for.
+//
+// Log appends are synchronous, but write_log() and install_trans()
+// start all of a transaction's block writes before waiting for any,
+// with runs of consecutive blocks written by single disk requests.
 
 // Contents of the header block, used for both the on-disk header block
 // and to keep track in memory of logged block# before commit.
@@ -42,9 +60,21 @@ struct log {
   int start;
   int size;
   int outstanding; // how many FS sys calls are executing.
-  int committing;  // in commit(), please wait.
+  int committing;  // a transaction is being committed.
+  int closing;     // in close_trans(), please wait.
   int dev;
-  struct logheader lh;
+  int seq;         // number of the open transaction
+  int done;        // number of the last transaction committed
+  struct logheader lh;   // the open transaction
+
+  // The committing transaction. snap[i] holds a copy of
+  // block clh.block[i], taken when the transaction closed,
+  // and pinned[i] is the cache buffer it was copied from.
+  // snap[] are not in the buffer cache; commit() points them
+  // at the log and then at the home locations to write them.
+  struct logheader clh;
+  struct buf snap[LOGSIZE];
+  struct buf *pinned[LOGSIZE];
 };
 struct log log;
 
@@ -54,6 +84,8 @@ static void commit();
 void
 initlog(int dev, struct superblock *sb)
 {
+  int i;
+
   if (sizeof(struct logheader) >= BSIZE)
     panic("initlog: too big logheader");
 
@@ -61,53 +93,98 @@ initlog(int dev, struct superblock *sb)
   log.start = sb->logstart;
   log.size = sb->nlog;
   log.dev = dev;
+  log.seq = 1;
+  for (i = 0; i < LOGSIZE; i++) {
+    initsleeplock(&log.snap[i].lock, "logsnap");
+    log.snap[i].dev = dev;
+  }
   recover_from_log();
 }
 
+// Write the copies in snap[] to the blocks that blockno(i)
+// names, keeping all the writes in flight at once. They are
+// started in block order, so that bwrite_startv() can write
+// each run of consecutive blocks with one disk request.
+static void
+write_snap(int (*blockno)(int))
+{
+  struct buf *bs[LOGSIZE], *b;
+  int i, j;
+
+  for (i = 0; i < log.clh.n; i++) {
+    b = &log.snap[i];
+    acquiresleep(&b->lock);
+    b->blockno = blockno(i);
+    for (j = i; j > 0 && bs[j-1]->blockno > b->blockno; j--)
+      bs[j] = bs[j-1];
+    bs[j] = b;
+  }
+  bwrite_startv(bs, log.clh.n);
+  for (i = 0; i < log.clh.n; i++) {
+    bwait(&log.snap[i]);
+    releasesleep(&log.snap[i].lock);
+  }
+}
+
+static int
+logblock(int i)
+{
+  return log.start + i + 1;
+}
+
+static int
+homeblock(int i)
+{
+  return log.clh.block[i];
+}
+
 // Copy committed blocks from log to their home location
 static void
 install_trans(int recovering)
 {
-  int tail;
-
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *lbuf = bread(log.dev, log.start+tail+1); // read log block
-    struct buf *dbuf = bread(log.dev, log.lh.block[tail]); // read dst
-    memmove(dbuf->data, lbuf->data, BSIZE);  // copy block to dst
-    bwrite(dbuf);  // write dst to disk
-    if(recovering == 0)
-      bunpin(dbuf);
-    brelse(lbuf);
-    brelse(dbuf);
+  int i;
+
+  write_snap(homeblock);
+  if (recovering == 0) {
+    for (i = 0; i < log.clh.n; i++)
+      bunpin(log.pinned[i]);
   }
 }
 
-// Read the log header from disk into the in-memory log header
+// Read the log header from disk into the in-memory header
+// of the committing transaction, and the logged blocks into snap[].
 static void
 read_head(void)
 {
   struct buf *buf = bread(log.dev, log.start);
   struct logheader *lh = (struct logheader *) (buf->data);
   int i;
-  log.lh.n = lh->n;
-  for (i = 0; i < log.lh.n; i++) {
-    log.lh.block[i] = lh->block[i];
+  log.clh.n = lh->n;
+  for (i = 0; i < log.clh.n; i++) {
+    log.clh.block[i] = lh->block[i];
   }
   brelse(buf);
+
+  breadahead(log.dev, logblock(0), log.clh.n);
+  for (i = 0; i < log.clh.n; i++) {
+    buf = bread(log.dev, logblock(i));
+    memmove(log.snap[i].data, buf->data, BSIZE);
+    brelse(buf);
+  }
 }
 
-// Write in-memory log header to disk.
+// Write the header of the committing transaction to disk.
 // This is the true point at which the
-// current transaction commits.
+// transaction commits.
 static void
 write_head(void)
 {
   struct buf *buf = bread(log.dev, log.start);
   struct logheader *hb = (struct logheader *) (buf->data);
   int i;
-  hb->n = log.lh.n;
-  for (i = 0; i < log.lh.n; i++) {
-    hb->block[i] = log.lh.block[i];
+  hb->n = log.clh.n;
+  for (i = 0; i < log.clh.n; i++) {
+    hb->block[i] = log.clh.block[i];
   }
   bwrite(buf);
   brelse(buf);
@@ -118,7 +195,7 @@ recover_from_log(void)
 {
   read_head();
   install_trans(1); // if committed, copy from log to disk
-  log.lh.n = 0;
+  log.clh.n = 0;
   write_head(); // clear the log
 }
 
@@ -128,7 +205,7 @@ begin_op(void)
 {
   acquire(&log.lock);
   while(1){
-    if(log.committing){
+    if(log.closing){
       sleep(&log, &log.lock);
     } else if(log.lh.n + (log.outstanding+1)*MAXOPBLOCKS > LOGSIZE){
       // this op might exhaust log space; wait for commit.
@@ -142,7 +219,9 @@ begin_op(void)
 }
 
 // called at the end of each FS system call.
-// commits if this was the last outstanding operation.
+// commits if this was the last outstanding operation,
+// unless another transaction is committing; commit()
+// will pick this one up when that finishes.
 void
 end_op(void)
 {
@@ -150,9 +229,9 @@ end_op(void)
 
   acquire(&log.lock);
   log.outstanding -= 1;
-  if(log.committing)
-    panic("log.committing");
-  if(log.outstanding == 0){
+  if(log.closing)
+    panic("log.closing");
+  if(log.outstanding == 0 && !log.committing){
     do_commit = 1;
     log.committing = 1;
   } else {
@@ -167,39 +246,71 @@ end_op(void)
     // call commit w/o holding locks, since not allowed
     // to sleep with locks.
     commit();
-    acquire(&log.lock);
-    log.committing = 0;
-    wakeup(&log);
-    release(&log.lock);
   }
 }
 
-// Copy modified blocks from cache to log.
+// Make the open transaction the committing one: copy its
+// header, and copy its blocks out of the cache into snap[]
+// so that the next transaction can go on changing them.
+// Caller has set log.closing, so no FS system calls
+// are active or can begin.
 static void
-write_log(void)
+close_trans(void)
 {
-  int tail;
+  struct buf *b;
+  int i;
 
-  for (tail = 0; tail < log.lh.n; tail++) {
-    struct buf *to = bread(log.dev, log.start+tail+1); // log block
-    struct buf *from = bread(log.dev, log.lh.block[tail]); // cache block
-    memmove(to->data, from->data, BSIZE);
-    bwrite(to);  // write the log
-    brelse(from);
-    brelse(to);
+  log.clh.n = log.lh.n;
+  for (i = 0; i < log.lh.n; i++) {
+    log.clh.block[i] = log.lh.block[i];
+    b = bread(log.dev, log.lh.block[i]);
+    memmove(log.snap[i].data, b->data, BSIZE);
+    log.pinned[i] = b;   // stays pinned until installed
+    brelse(b);
   }
 }
 
+// Copy modified blocks to the log.
+static void
+write_log(void)
+{
+  write_snap(logblock);
+}
+
+// Commit the open transaction, and any that close while
+// that one is being written. Caller has set log.committing.
 static void
 commit()
 {
-  if (log.lh.n > 0) {
-    write_log();     // Write modified blocks from cache to log
+  int seq;
+
+  acquire(&log.lock);
+  while (log.outstanding == 0 && log.lh.n > 0) {
+    log.closing = 1;
+    seq = log.seq;
+    release(&log.lock);
+    close_trans();
+    acquire(&log.lock);
+    log.lh.n = 0;
+    log.seq++;
+    log.closing = 0;
+    wakeup(&log);  // start the next transaction
+    release(&log.lock);
+
+    bflush(1);       // Write the data of new blocks
+    write_log();     // Write copied blocks to log
     write_head();    // Write header to disk -- the real commit
     install_trans(0); // Now install writes to home locations
-    log.lh.n = 0;
+    log.clh.n = 0;
     write_head();    // Erase the transaction from the log
+
+    acquire(&log.lock);
+    log.done = seq;
+    wakeup(&log);
   }
+  log.committing = 0;
+  wakeup(&log);
+  release(&log.lock);
 }
 
 // Caller has modified b->data and is done with the buffer.
@@ -234,3 +345,42 @@ log_write(struct buf *b)
   release(&log.lock);
 }
 
+
+// Return the number of the open transaction. It can't
+// change during an FS system call.
+int
+log_seq(void)
+{
+  int seq;
+
+  acquire(&log.lock);
+  seq = log.seq;
+  release(&log.lock);
+  return seq;
+}
+
+// Return the number of the last transaction committed.
+int
+log_done(void)
+{
+  int done;
+
+  acquire(&log.lock);
+  done = log.done;
+  release(&log.lock);
+  return done;
+}
+
+// Wait until every transaction that has closed or has updates
+// in it, so every completed FS system call, has committed.
+void
+log_sync(void)
+{
+  int seq;
+
+  acquire(&log.lock);
+  seq = log.lh.n > 0 ? log.seq : log.seq - 1;
+  while (log.done < seq)
+    sleep(&log, &log.lock);
+  release(&log.lock);
+}
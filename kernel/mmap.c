@@ -0,0 +1,567 @@
+//
+// Memory-mapped files.
+//
+// mmap() gives a process a region of its address space, above
+// the heap and below the trapframe, whose pages come from a
+// file. Nothing is read until the process touches a page:
+// vmfault() then calls vmafault(), which maps the file's page
+// from the page cache.
+//
+// The page cache holds one physical page for each page of file
+// data it has read, so that every process mapping a file sees
+// the same pages. A MAP_SHARED region maps the cached pages
+// writable, and munmap() (or exit() or exec()) writes back
+// through the log the ones the process has written, which the
+// hardware marks PTE_D. A MAP_PRIVATE region maps them
+// copy-on-write, so that a store gets a private copy.
+//
+// writei() keeps the cached pages up to date with the file,
+// and itrunc() drops a file's pages from the cache; a page
+// that is still mapped then stays with its mappings, but is no
+// longer the file's. Entries point at the in-memory inode, and
+// go when the inode table recycles it.
+//
+// The cache owns one kalloc() reference to each of its pages.
+// A page that only the cache refers to can be evicted to make
+// room for another. So at most NPGCACHE pages of MAP_SHARED
+// regions can be mapped at once, counting the text pages of
+// running programs; a fault on one more fails, since a page
+// outside the cache would not be shared.
+//
+// exec() maps the segments of a big program as VMA_IMAGE
+// regions, which vmafault() fills with private pages read
+// straight from the file, zeroing the bss past filesz.
+// Read-only pages of a program, its text, come from the page
+// cache instead, so every process running the program maps
+// the same pages. The file of a running program can't be
+// written or truncated (see idenywrite()), so every page a
+// program faults in, early or late, comes from the same file
+// contents. Once no program runs it, writei() drops its cached
+// text pages rather than updating them, and the next exec()
+// reads the new text.
+//
+
+#include "types.h"
+#include "param.h"
+#include "memlayout.h"
+#include "riscv.h"
+#include "spinlock.h"
+#include "sleeplock.h"
+#include "fs.h"
+#include "file.h"
+#include "proc.h"
+#include "fcntl.h"
+#include "defs.h"
+
+struct pgent {
+  struct inode *ip;
+  uint off;       // file offset, page-aligned
+  int text;       // program text, not updated by writei()
+  char *pa;       // the page, or 0 if the entry is free
+};
+
+struct {
+  struct spinlock lock;
+  struct pgent ent[NPGCACHE];
+  int hand;       // where the search for a page to evict resumes
+} pgcache;
+
+void
+mmapinit(void)
+{
+  initlock(&pgcache.lock, "pgcache");
+}
+
+// Find the cached page of ip's data at off, for mmap()
+// or, if text is set, for program text.
+// pgcache.lock must be held.
+static struct pgent*
+pglookup(struct inode *ip, uint off, int text)
+{
+  struct pgent *e;
+
+  for(e = pgcache.ent; e < &pgcache.ent[NPGCACHE]; e++)
+    if(e->pa && e->ip == ip && e->off == off && e->text == text)
+      return e;
+  return 0;
+}
+
+// Find a free entry, evicting a page no one maps if need be.
+// pgcache.lock must be held. Returns 0 if every page is mapped.
+static struct pgent*
+pgalloc(void)
+{
+  struct pgent *e;
+  int i;
+
+  for(e = pgcache.ent; e < &pgcache.ent[NPGCACHE]; e++)
+    if(e->pa == 0)
+      return e;
+
+  // a page with just the cache's reference gains another
+  // only in pgget() or pgupdate(), with pgcache.lock held,
+  // so the count can't grow under us.
+  for(i = 0; i < NPGCACHE; i++){
+    e = &pgcache.ent[pgcache.hand];
+    pgcache.hand = (pgcache.hand + 1) % NPGCACHE;
+    if(krefcnt(e->pa) == 1){
+      kfree(e->pa);
+      e->pa = 0;
+      e->ip->npage--;
+      return e;
+    }
+  }
+  return 0;
+}
+
+// Return the page of ip's data at page-aligned offset off,
+// for mmap() or for program text, with a reference for the
+// caller, reading it in if it is not cached. Bytes past the
+// end of the file read as zero. If the cache has no room, a
+// caller that will only read the page or copy it (private)
+// gets a page of its own.
+// The caller must not hold ip's lock.
+// Returns 0 if there is no memory, or no room for a
+// caller that isn't private.
+static char*
+pgget(struct inode *ip, uint off, int text, int private)
+{
+  struct pgent *e;
+  char *pa;
+
+  acquire(&pgcache.lock);
+  if((e = pglookup(ip, off, text)) != 0){
+    pa = e->pa;
+    krefinc(pa);
+    release(&pgcache.lock);
+    return pa;
+  }
+  release(&pgcache.lock);
+
+  if((pa = kalloc()) == 0)
+    return 0;
+  memset(pa, 0, PGSIZE);
+
+  // hold ip's lock until the page is in the cache,
+  // so that writei() can't change the file in between.
+  ilock(ip);
+  readi(ip, 0, (uint64)pa, off, PGSIZE);
+  acquire(&pgcache.lock);
+  if((e = pglookup(ip, off, text)) != 0){
+    // read in by someone else meanwhile.
+    kfree(pa);
+    pa = e->pa;
+    krefinc(pa);
+  } else if((e = pgalloc()) != 0){
+    e->ip = ip;
+    ip->npage++;
+    e->off = off;
+    e->text = text;
+    e->pa = pa;
+    krefinc(pa);
+  } else if(!private){
+    kfree(pa);
+    pa = 0;
+  }
+  release(&pgcache.lock);
+  iunlock(ip);
+  return pa;
+}
+
+// writei() changed n bytes of ip's data at off; bring any
+// cached mmap() pages holding them up to date, and drop
+// cached text pages, which must not change under programs.
+// Called with ip locked.
+void
+pgupdate(struct inode *ip, uint off, uint n)
+{
+  struct pgent *e;
+  uint a, lo, hi;
+  char *pa;
+
+  // most files have no cached pages. pgget() adds them only
+  // with ip locked, as it is here, so the count can't grow
+  // under us.
+  if(ip->npage == 0)
+    return;
+
+  for(a = PGROUNDDOWN(off); a < off + n; a += PGSIZE){
+    acquire(&pgcache.lock);
+    if((e = pglookup(ip, a, 1)) != 0){
+      kfree(e->pa);
+      e->pa = 0;
+      ip->npage--;
+    }
+    pa = 0;
+    if((e = pglookup(ip, a, 0)) != 0){
+      pa = e->pa;
+      krefinc(pa);
+    }
+    release(&pgcache.lock);
+    if(pa == 0)
+      continue;
+    lo = a < off ? off : a;
+    hi = a + PGSIZE < off + n ? a + PGSIZE : off + n;
+    readi(ip, 0, (uint64)pa + (lo - a), lo, hi - lo);
+    kfree(pa);
+  }
+}
+
+// ip is being truncated, or its table entry recycled; drop
+// its pages from the cache.
+// Called with ip locked, or with no references to ip.
+void
+pgdrop(struct inode *ip)
+{
+  struct pgent *e;
+
+  if(ip->npage == 0)
+    return;
+  acquire(&pgcache.lock);
+  for(e = pgcache.ent; e < &pgcache.ent[NPGCACHE]; e++){
+    if(e->pa && e->ip == ip){
+      kfree(e->pa);
+      e->pa = 0;
+      ip->npage--;
+    }
+  }
+  release(&pgcache.lock);
+}
+
+// Find p's mmap() region that contains va.
+struct vma*
+vmafind(struct proc *p, uint64 va)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->ip && v->start <= va && va < v->end)
+      return v;
+  return 0;
+}
+
+// Return the lowest address of p's mmap() regions, or
+// TRAPFRAME if there are none. The heap must stay below it.
+uint64
+mmapbase(struct proc *p)
+{
+  struct vma *v;
+  uint64 base = TRAPFRAME;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->ip && (v->flags & VMA_IMAGE) == 0 && v->start < base)
+      base = v->start;
+  return base;
+}
+
+// Return a new page holding the page at offset off of the
+// program image segment v: file data up to v->filesz, then
+// zeros. The caller must not hold v->ip's lock.
+// Returns 0 if there is no memory.
+static char*
+imageget(struct vma *v, uint64 off)
+{
+  char *pa;
+
+  if((pa = kalloc()) == 0)
+    return 0;
+  memset(pa, 0, PGSIZE);
+  if(off < v->filesz){
+    ilock(v->ip);
+    readi(v->ip, 0, (uint64)pa, v->off + off, v->filesz - off < PGSIZE ? v->filesz - off : PGSIZE);
+    iunlock(v->ip);
+  }
+  return pa;
+}
+
+// Is this hart holding a spinlock, so that it must not sleep?
+static int
+holdinglocks(void)
+{
+  int n;
+
+  push_off();
+  n = mycpu()->noff;
+  pop_off();
+  return n > 1;
+}
+
+// Map the page at va of the current process's mmap() region
+// that contains it, for an instruction fetch if exec is set.
+// Called by vmfault().
+// Returns 0 on success, or -1 if no region allows access to
+// va, or if there is no memory.
+int
+vmafault(struct proc *p, uint64 va, int exec)
+{
+  struct vma *v;
+  char *pa;
+  int perm;
+
+  va = PGROUNDDOWN(va);
+  if((v = vmafind(p, va)) == 0 || v->prot == PROT_NONE)
+    return -1;
+  if(exec && (v->prot & PROT_EXEC) == 0)
+    return -1;
+
+  // copyout() from wait() or piperead() holds a spinlock,
+  // and can't sleep to read the file; wait(), read() and
+  // write() call mmapprefault() first, so that only a page
+  // the cache has no room for gets here.
+  if(holdinglocks())
+    return -1;
+
+  // risc-v has no write-only pages.
+  perm = PTE_U | PTE_R;
+  if(v->prot & PROT_EXEC)
+    perm |= PTE_X;
+
+  if(v->flags & VMA_IMAGE){
+    if((v->prot & PROT_WRITE) == 0 && va - v->start + PGSIZE <= v->filesz)
+      pa = pgget(v->ip, v->off + (va - v->start), 1, 1);
+    else
+      pa = imageget(v, va - v->start);
+    if(pa == 0)
+      return -1;
+    if(v->prot & PROT_WRITE)
+      perm |= PTE_W;
+  } else {
+    pa = pgget(v->ip, v->off + (va - v->start), 0, (v->flags & MAP_SHARED) == 0);
+    if(pa == 0)
+      return -1;
+    if(v->prot & PROT_WRITE)
+      perm |= (v->flags & MAP_SHARED) ? PTE_W : PTE_COW;
+  }
+  if(mappages(p->pagetable, va, PGSIZE, (uint64)pa, perm) != 0){
+    kfree(pa);
+    return -1;
+  }
+  return 0;
+}
+
+// Fault in the pages of mmap() regions among the n bytes at
+// user address va, before read() or write() copies to or from
+// them while holding locks, such as the lock of the very file
+// the pages come from, that vmafault() may need.
+void
+mmapprefault(uint64 va, uint64 n, int write)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  uint64 a, lo, hi;
+  pte_t *pte;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->ip == 0)
+      continue;
+    lo = va > v->start ? PGROUNDDOWN(va) : v->start;
+    hi = va + n < v->end ? va + n : v->end;
+    for(a = lo; a < hi; a += PGSIZE){
+      pte = walk(p->pagetable, a, 0);
+      if(pte == 0 || (*pte & PTE_V) == 0 || (write && (*pte & PTE_COW)))
+        vmfault(p->pagetable, a, write, 0);
+    }
+  }
+}
+
+// Map n bytes of file f at offset off, with protection prot,
+// into the current process. Returns the address of the
+// mapping, or -1 on error.
+uint64
+mmap(uint64 n, int prot, int flags, struct file *f, uint off)
+{
+  struct proc *p = myproc();
+  struct vma *v, *free;
+  uint64 end;
+  int i;
+
+  if(n == 0 || n > MAXVA || off % PGSIZE != 0)
+    return -1;
+  if(flags != MAP_SHARED && flags != MAP_PRIVATE)
+    return -1;
+  if(f->type != FD_INODE || f->readable == 0)
+    return -1;
+  if(flags == MAP_SHARED && (prot & PROT_WRITE) && f->writable == 0)
+    return -1;
+  n = PGROUNDUP(n);
+
+  free = 0;
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->ip == 0)
+      free = v;
+  if(free == 0)
+    return -1;
+
+  // take the highest gap big enough.
+  end = TRAPFRAME;
+  for(i = 0; i < NVMA; i++){
+    v = &p->vma[i];
+    if(v->ip && v->start < end && end - n < v->end){
+      end = v->start;
+      i = -1;  // start over
+    }
+  }
+  if(end < n || end - n < PGROUNDUP(p->sz))
+    return -1;
+
+  free->start = end - n;
+  free->end = end;
+  free->prot = prot;
+  free->flags = flags;
+  free->off = off;
+  free->filesz = 0;
+  free->ip = idup(f->ip);
+  return free->start;
+}
+
+// Write back a MAP_SHARED page of ip at off.
+static void
+writeback(struct inode *ip, char *pa, uint off)
+{
+  bthrottle();
+  begin_op();
+  ilock(ip);
+  if(off < ip->size)
+    writei(ip, 0, (uint64)pa, off, ip->size - off < PGSIZE ? ip->size - off : PGSIZE);
+  iunlock(ip);
+  end_op();
+}
+
+// Remove the pages of region v from lo to hi from p's page
+// table, writing back the ones a MAP_SHARED region has written.
+static void
+vmaunmap(struct proc *p, struct vma *v, uint64 lo, uint64 hi)
+{
+  uint64 a;
+  pte_t *pte;
+
+  if(v->flags & MAP_SHARED){
+    for(a = lo; a < hi; a += PGSIZE){
+      pte = walk(p->pagetable, a, 0);
+      if(pte && (*pte & PTE_V) && (*pte & PTE_D))
+        writeback(v->ip, (char*)PTE2PA(*pte), v->off + (a - v->start));
+    }
+  }
+  uvmunmap(p->pagetable, lo, (hi - lo) / PGSIZE, 1);
+  asidretire(p);
+}
+
+// Take another reference to the file of region v, a copy of
+// another region.
+static void
+vmadup(struct vma *v)
+{
+  idup(v->ip);
+  if(v->flags & VMA_IMAGE)
+    idenywrite(v->ip);
+}
+
+// Drop region v's reference to its file, and the region.
+static void
+vmaput(struct vma *v)
+{
+  if(v->flags & VMA_IMAGE)
+    iallowwrite(v->ip);
+  begin_op();
+  iput(v->ip);
+  end_op();
+  v->ip = 0;
+}
+
+// Make region v start at a, further in.
+static void
+vmatrim(struct vma *v, uint64 a)
+{
+  v->off += a - v->start;
+  v->filesz = v->filesz > a - v->start ? v->filesz - (a - v->start) : 0;
+  v->start = a;
+}
+
+// Unmap the n bytes at addr from the current process.
+// They need not all be mapped, but addr must be page-aligned.
+// Returns 0 on success, -1 on error.
+int
+munmap(uint64 addr, uint64 n)
+{
+  struct proc *p = myproc();
+  struct vma *v, *free;
+  uint64 lo, hi, end;
+
+  if(addr % PGSIZE != 0 || n == 0 || addr + n < addr || addr + n > MAXVA)
+    return -1;
+  end = PGROUNDUP(addr + n);
+
+  // splitting a region in two takes another vma.
+  free = 0;
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->ip == 0)
+      free = v;
+  for(v = p->vma; v < &p->vma[NVMA]; v++)
+    if(v->ip && v->start < addr && end < v->end && free == 0)
+      return -1;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->ip == 0 || end <= v->start || v->end <= addr)
+      continue;
+    lo = addr > v->start ? addr : v->start;
+    hi = end < v->end ? end : v->end;
+    vmaunmap(p, v, lo, hi);
+    if(lo == v->start && hi == v->end){
+      vmaput(v);
+    } else if(lo == v->start){
+      vmatrim(v, hi);
+    } else if(hi == v->end){
+      v->end = lo;
+    } else {
+      *free = *v;
+      vmatrim(free, hi);
+      vmadup(free);
+      v->end = lo;
+    }
+  }
+  return 0;
+}
+
+// Unmap all of p's mmap() regions, for exit() and exec().
+void
+munmapall(struct proc *p)
+{
+  struct vma *v;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->ip == 0)
+      continue;
+    vmaunmap(p, v, v->start, v->end);
+    vmaput(v);
+  }
+}
+
+// Give child np the mmap() regions of its parent p.
+// MAP_SHARED pages are shared as they are; MAP_PRIVATE
+// ones become copy-on-write, as with uvmcopy(). The pages
+// of VMA_IMAGE regions, below p->sz, fork() has copied.
+// Returns 0 on success, -1 on failure, having
+// unmapped any pages it mapped.
+int
+vmacopy(struct proc *p, struct proc *np)
+{
+  struct vma *v, *w;
+
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->ip == 0 || (v->flags & VMA_IMAGE))
+      continue;
+    if(uvmcopy(p->pagetable, np->pagetable, v->start, v->end, v->flags & MAP_SHARED) < 0){
+      for(w = p->vma; w < v; w++)
+        if(w->ip && (w->flags & VMA_IMAGE) == 0)
+          uvmunmap(np->pagetable, w->start, (w->end - w->start) / PGSIZE, 1);
+      return -1;
+    }
+  }
+  for(v = p->vma; v < &p->vma[NVMA]; v++){
+    if(v->ip == 0)
+      continue;
+    np->vma[v - p->vma] = *v;
+    vmadup(&np->vma[v - p->vma]);
+  }
+  return 0;
+}
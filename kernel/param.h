@@ -2,12 +2,18 @@
 #define NCPU          8  // maximum number of CPUs
 #define NOFILE       16  // open files per process
 #define NFILE       100  // open files per system
-#define NINODE       50  // maximum number of active i-nodes
+#define NINODE      100  // i-nodes cached before reusing unreferenced ones
+#define NDCACHE     128  // directory names the name cache remembers
 #define NDEV         10  // maximum major device number
 #define ROOTDEV       1  // device number of file system root disk
 #define MAXARG       32  // max exec arguments
-#define MAXOPBLOCKS  10  // max # of blocks any FS op writes
+#define MAXOPBLOCKS  16  // max # of blocks any FS op writes
 #define LOGSIZE      (MAXOPBLOCKS*3)  // max data blocks in on-disk log
-#define NBUF         (MAXOPBLOCKS*3)  // size of disk block cache
-#define FSSIZE       2000  // size of file system in blocks
+#define NBUF         (MAXOPBLOCKS*9)  // size of disk block cache
+#define NDISKQ       10  // max disk requests a caller keeps in flight
+#define NCLUSTER     8   // max consecutive blocks in one disk request
+#define FLUSHTICKS   10  // ticks between write-backs of dirty file data
+#define FSSIZE       100000  // size of file system in blocks
 #define MAXPATH      128   // maximum file path name
+#define NVMA         16  // mmap() regions per process
+#define NPGCACHE    128  // pages the page cache holds, max MAP_SHARED pages mapped
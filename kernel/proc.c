@@ -5,6 +5,7 @@
 #include "spinlock.h"
 #include "proc.h"
 #include "defs.h"
+#include "kstat.h"
 
 struct cpu cpus[NCPU];
 
@@ -16,10 +17,36 @@ int nextpid = 1;
 struct spinlock pid_lock;
 
 extern void forkret(void);
+static void kthreadret(void);
 static void freeproc(struct proc *p);
+static void setrunnable(struct proc *p);
+static void kick(int id);
 
 extern char trampoline[]; // trampoline.S
 
+// Processes sleeping in sleep(), hashed by chan,
+// so that wakeup() need only look at the processes
+// sleeping on channels with the same hash.
+// A process is on a wait queue exactly when it is SLEEPING.
+// A queue's lock must be acquired before any p->lock.
+#define NWAITQ 61
+#define WQHASH(chan) ((((uint64)(chan)) >> 3) % NWAITQ)
+
+struct {
+  struct spinlock lock;
+  struct proc *head;
+} waitq[NWAITQ];
+
+// Per-hart queues of RUNNABLE processes, in FIFO order.
+// A process is on a run queue exactly when it is RUNNABLE.
+// p->lock must be acquired before any run queue lock.
+struct runq {
+  struct spinlock lock;
+  struct proc *head;
+  struct proc *tail;
+  int n;
+} runq[NCPU];
+
 // helps ensure that wakeups of wait()ing
 // parents are not lost. helps obey the
 // memory model when using p->parent.
@@ -48,9 +75,14 @@ void
 procinit(void)
 {
   struct proc *p;
+  int i;
   
   initlock(&pid_lock, "nextpid");
   initlock(&wait_lock, "wait_lock");
+  for(i = 0; i < NWAITQ; i++)
+    initlock(&waitq[i].lock, "waitq");
+  for(i = 0; i < NCPU; i++)
+    initlock(&runq[i].lock, "runq");
   for(p = proc; p < &proc[NPROC]; p++) {
       initlock(&p->lock, "proc");
       p->state = UNUSED;
@@ -124,6 +156,7 @@ allocproc(void)
 found:
   p->pid = allocpid();
   p->state = USED;
+  p->asidgen = 0;
 
   // Allocate a trapframe page.
   if((p->trapframe = (struct trapframe *)kalloc()) == 0){
@@ -168,6 +201,7 @@ freeproc(struct proc *p)
   p->chan = 0;
   p->killed = 0;
   p->xstate = 0;
+  p->kfn = 0;
   p->state = UNUSED;
 }
 
@@ -249,12 +283,39 @@ userinit(void)
   safestrcpy(p->name, "initcode", sizeof(p->name));
   p->cwd = namei("/");
 
-  p->state = RUNNABLE;
+  p->lastcpu = cpuid();
+  setrunnable(p);
 
   release(&p->lock);
 }
 
+// Start a kernel thread, a process with no user memory
+// that runs fn() in the kernel. fn() must never return.
+// Return 0 on success, -1 if there is no free proc.
+int
+kthread(char *name, void (*fn)(void))
+{
+  struct proc *p;
+
+  if((p = allocproc()) == 0)
+    return -1;
+  p->kfn = fn;
+  p->context.ra = (uint64)kthreadret;
+  safestrcpy(p->name, name, sizeof(p->name));
+
+  p->lastcpu = cpuid();
+  setrunnable(p);
+
+  release(&p->lock);
+  return 0;
+}
+
 // Grow or shrink user memory by n bytes.
+// Growing only moves p->sz; vmfault() allocates
+// each page when it is first touched. So growing
+// overcommits: it succeeds whatever memory is free,
+// and a process that touches a page when none is
+// left is killed with an "out of memory" message.
 // Return 0 on success, -1 on failure.
 int
 growproc(int n)
@@ -264,11 +325,12 @@ growproc(int n)
 
   sz = p->sz;
   if(n > 0){
-    if((sz = uvmalloc(p->pagetable, sz, sz + n, PTE_W)) == 0) {
+    if(sz + n > mmapbase(p))
       return -1;
-    }
+    sz += n;
   } else if(n < 0){
     sz = uvmdealloc(p->pagetable, sz, sz + n);
+    asidretire(p);
   }
   p->sz = sz;
   return 0;
@@ -289,12 +351,19 @@ fork(void)
   }
 
   // Copy user memory from parent to child.
-  if(uvmcopy(p->pagetable, np->pagetable, p->sz) < 0){
+  if(uvmcopy(p->pagetable, np->pagetable, 0, p->sz, 0) < 0){
     freeproc(np);
     release(&np->lock);
     return -1;
   }
   np->sz = p->sz;
+  if(vmacopy(p, np) < 0){
+    freeproc(np);
+    release(&np->lock);
+    return -1;
+  }
+  // uvmcopy() made p's writable pages copy-on-write.
+  asidretire(p);
 
   // copy saved user registers.
   *(np->trapframe) = *(p->trapframe);
@@ -319,7 +388,8 @@ fork(void)
   release(&wait_lock);
 
   acquire(&np->lock);
-  np->state = RUNNABLE;
+  np->lastcpu = cpuid();
+  setrunnable(np);
   release(&np->lock);
 
   return pid;
@@ -351,6 +421,9 @@ exit(int status)
   if(p == initproc)
     panic("init exiting");
 
+  // Unmap mmap() regions, writing back shared pages.
+  munmapall(p);
+
   // Close all open files.
   for(int fd = 0; fd < NOFILE; fd++){
     if(p->ofile[fd]){
@@ -394,6 +467,11 @@ wait(uint64 addr)
   int havekids, pid;
   struct proc *p = myproc();
 
+  // the copyout() below holds spinlocks, and can't read
+  // in a page of an mmap() region.
+  if(addr != 0)
+    mmapprefault(addr, sizeof(int), 1);
+
   acquire(&wait_lock);
 
   for(;;){
@@ -434,10 +512,137 @@ wait(uint64 addr)
   }
 }
 
+// Mark p RUNNABLE and add it to the run queue of the hart
+// it last ran on, whose caches most likely still hold its data.
+// Caller must hold p->lock.
+static void
+setrunnable(struct proc *p)
+{
+  struct runq *rq = &runq[p->lastcpu];
+  int i;
+
+  p->state = RUNNABLE;
+  p->rqnext = 0;
+  acquire(&rq->lock);
+  if(rq->tail)
+    rq->tail->rqnext = p;
+  else
+    rq->head = p;
+  rq->tail = p;
+  rq->n++;
+  release(&rq->lock);
+
+  // If p's hart is idle, wake it. Otherwise wake
+  // an idle hart, which may steal p.
+  __sync_synchronize();
+  if(cpus[p->lastcpu].idle){
+    kick(p->lastcpu);
+  } else {
+    for(i = 0; i < NCPU; i++){
+      if(cpus[i].idle){
+        kick(i);
+        break;
+      }
+    }
+  }
+}
+
+// Take the process at the head of run queue rq, if any.
+static struct proc*
+runq_pop(struct runq *rq)
+{
+  struct proc *p;
+
+  acquire(&rq->lock);
+  if((p = rq->head) != 0){
+    rq->head = p->rqnext;
+    if(rq->head == 0)
+      rq->tail = 0;
+    rq->n--;
+  }
+  release(&rq->lock);
+  return p;
+}
+
+// May an idle hart take a process from victim's run queue?
+// Leave a hart its only queued process unless the hart
+// is busy running something else, since it will soon run
+// the process itself with a warm cache. The counts are
+// read without locks; they only guide the choice.
+static int
+stealable(int victim)
+{
+  return runq[victim].n >= 2 ||
+    (runq[victim].n == 1 && cpus[victim].proc != 0);
+}
+
+// Find a process for idle hart id to take from another hart.
+static struct proc*
+steal(int id)
+{
+  struct proc *p;
+  int i, victim;
+
+  for(i = 1; i < NCPU; i++){
+    victim = (id + i) % NCPU;
+    if(stealable(victim) && (p = runq_pop(&runq[victim])) != 0)
+      return p;
+  }
+  return 0;
+}
+
+// Wake hart id from wfi with a CLINT software interrupt,
+// which timervec passes on to devintr().
+static void
+kick(int id)
+{
+  *(uint32*)CLINT_MSIP(id) = 1;
+}
+
+// Wait in wfi until an interrupt arrives, perhaps a kick()
+// from a hart that has queued a process for this one,
+// and add the time spent to c->idletime.
+// Interrupts stay off from announcing c->idle until wfi,
+// so that a kick meanwhile leaves its interrupt pending
+// and wfi returns at once rather than missing it.
+static void
+idle(struct cpu *c, int id)
+{
+  uint64 t0;
+  int i;
+
+  intr_off();
+  c->idle = 1;
+  __sync_synchronize();
+  for(i = 0; i < NCPU; i++){
+    if(i == id ? runq[i].n > 0 : stealable(i))
+      break;
+  }
+  if(i == NCPU){
+    t0 = *(uint64*)CLINT_MTIME;
+    wfi();
+    c->idletime += *(uint64*)CLINT_MTIME - t0;
+  }
+  c->idle = 0;
+  intr_on();
+}
+
+// Report each hart's idle time, and the current time.
+void
+idlestats(struct kstat *st)
+{
+  int i;
+
+  st->time = *(uint64*)CLINT_MTIME;
+  for(i = 0; i < NCPU; i++)
+    st->idle[i] = cpus[i].idletime;
+}
+
 // Per-CPU process scheduler.
 // Each CPU calls scheduler() after setting itself up.
 // Scheduler never returns.  It loops, doing:
-//  - choose a process to run.
+//  - choose a process to run, from this CPU's run queue
+//    or else from another CPU's.
 //  - swtch to start running that process.
 //  - eventually that process transfers control
 //    via swtch back to the scheduler.
@@ -446,28 +651,35 @@ scheduler(void)
 {
   struct proc *p;
   struct cpu *c = mycpu();
+  int id = cpuid();
   
   c->proc = 0;
   for(;;){
     // Avoid deadlock by ensuring that devices can interrupt.
     intr_on();
 
-    for(p = proc; p < &proc[NPROC]; p++) {
-      acquire(&p->lock);
-      if(p->state == RUNNABLE) {
-        // Switch to chosen process.  It is the process's job
-        // to release its lock and then reacquire it
-        // before jumping back to us.
-        p->state = RUNNING;
-        c->proc = p;
-        swtch(&c->context, &p->context);
-
-        // Process is done running for now.
-        // It should have changed its p->state before coming back.
-        c->proc = 0;
-      }
-      release(&p->lock);
+    if((p = runq_pop(&runq[id])) == 0 && (p = steal(id)) == 0){
+      idle(c, id);
+      continue;
     }
+
+    // p may still be switching away on the hart that queued
+    // it; acquiring p->lock waits for it to finish.
+    acquire(&p->lock);
+    if(p->state != RUNNABLE)
+      panic("scheduler");
+    // Switch to chosen process.  It is the process's job
+    // to release its lock and then reacquire it
+    // before jumping back to us.
+    p->state = RUNNING;
+    p->lastcpu = id;
+    c->proc = p;
+    swtch(&c->context, &p->context);
+
+    // Process is done running for now.
+    // It should have changed its p->state before coming back.
+    c->proc = 0;
+    release(&p->lock);
   }
 }
 
@@ -504,7 +716,7 @@ yield(void)
 {
   struct proc *p = myproc();
   acquire(&p->lock);
-  p->state = RUNNABLE;
+  setrunnable(p);
   sched();
   release(&p->lock);
 }
@@ -530,26 +742,44 @@ forkret(void)
   usertrapret();
 }
 
+// A kernel thread's very first scheduling by scheduler()
+// will swtch to kthreadret.
+static void
+kthreadret(void)
+{
+  struct proc *p = myproc();
+
+  // Still holding p->lock from scheduler.
+  release(&p->lock);
+  p->kfn();
+  panic("kthread returned");
+}
+
 // Atomically release lock and sleep on chan.
 // Reacquires lock when awakened.
 void
 sleep(void *chan, struct spinlock *lk)
 {
   struct proc *p = myproc();
+  int h = WQHASH(chan);
   
   // Must acquire p->lock in order to
   // change p->state and then call sched.
-  // Once we hold p->lock, we can be
+  // Once we hold chan's wait queue lock, we can be
   // guaranteed that we won't miss any wakeup
-  // (wakeup locks p->lock),
+  // (wakeup locks the wait queue),
   // so it's okay to release lk.
 
+  acquire(&waitq[h].lock);
   acquire(&p->lock);  //DOC: sleeplock1
   release(lk);
 
   // Go to sleep.
   p->chan = chan;
   p->state = SLEEPING;
+  p->wqnext = waitq[h].head;
+  waitq[h].head = p;
+  release(&waitq[h].lock);
 
   sched();
 
@@ -566,17 +796,42 @@ sleep(void *chan, struct spinlock *lk)
 void
 wakeup(void *chan)
 {
-  struct proc *p;
-
-  for(p = proc; p < &proc[NPROC]; p++) {
-    if(p != myproc()){
+  struct proc *p, **pp;
+  int h = WQHASH(chan);
+
+  acquire(&waitq[h].lock);
+  for(pp = &waitq[h].head; (p = *pp) != 0; ){
+    if(p->chan == chan){
+      *pp = p->wqnext;
+      // wait for p to finish switching away in sleep().
       acquire(&p->lock);
-      if(p->state == SLEEPING && p->chan == chan) {
-        p->state = RUNNABLE;
-      }
+      setrunnable(p);
       release(&p->lock);
+    } else {
+      pp = &p->wqnext;
     }
   }
+  release(&waitq[h].lock);
+}
+
+// Wake p if it is still sleeping on chan.
+// Must be called without any p->lock.
+static void
+wakeproc(struct proc *p, void *chan)
+{
+  struct proc **pp;
+  int h = WQHASH(chan);
+
+  acquire(&waitq[h].lock);
+  acquire(&p->lock);
+  if(p->state == SLEEPING && p->chan == chan){
+    for(pp = &waitq[h].head; *pp != p; pp = &(*pp)->wqnext)
+      ;
+    *pp = p->wqnext;
+    setrunnable(p);
+  }
+  release(&p->lock);
+  release(&waitq[h].lock);
 }
 
 // Kill the process with the given pid.
@@ -586,16 +841,19 @@ int
 kill(int pid)
 {
   struct proc *p;
+  void *chan;
 
   for(p = proc; p < &proc[NPROC]; p++){
     acquire(&p->lock);
     if(p->pid == pid){
       p->killed = 1;
-      if(p->state == SLEEPING){
-        // Wake process from sleep().
-        p->state = RUNNABLE;
-      }
+      chan = p->state == SLEEPING ? p->chan : 0;
       release(&p->lock);
+      if(chan){
+        // Wake process from sleep(). Its wait queue
+        // lock comes before p->lock, so look again.
+        wakeproc(p, chan);
+      }
       return 0;
     }
     release(&p->lock);
@@ -24,6 +24,9 @@ struct cpu {
   struct context context;     // swtch() here to enter scheduler().
   int noff;                   // Depth of push_off() nesting.
   int intena;                 // Were interrupts enabled before push_off()?
+  int idle;                   // Waiting in wfi for something to run?
+  uint64 idletime;            // CLINT time units spent idle.
+  uint64 asidgen;             // ASID generation the TLB is clean for.
 };
 
 extern struct cpu cpus[NCPU];
@@ -79,6 +82,21 @@ struct trapframe {
   /* 280 */ uint64 t6;
 };
 
+// A region of user memory whose pages come from a file (see mmap.c).
+struct vma {
+  uint64 start;                // First address, page-aligned
+  uint64 end;                  // One past the last address, page-aligned
+  int prot;                    // PROT_* bits
+  int flags;                   // MAP_SHARED or MAP_PRIVATE
+  struct inode *ip;            // File, or 0 if the vma is unused
+  uint off;                    // File offset of start, page-aligned
+  uint filesz;                 // Bytes of file data, then zeros (VMA_IMAGE only)
+};
+
+// vma flags bit for a segment of the program image, which
+// exec() maps below p->sz rather than mmap() above it.
+#define VMA_IMAGE 0x100
+
 enum procstate { UNUSED, USED, SLEEPING, RUNNABLE, RUNNING, ZOMBIE };
 
 // Per-process state
@@ -91,17 +109,27 @@ struct proc {
   int killed;                  // If non-zero, have been killed
   int xstate;                  // Exit status to be returned to parent's wait
   int pid;                     // Process ID
+  int lastcpu;                 // Hart the process last ran on
+  struct proc *rqnext;         // Next process in the same run queue
 
   // wait_lock must be held when using this:
   struct proc *parent;         // Parent process
 
+  // the lock of p->chan's wait queue must be held when using this:
+  struct proc *wqnext;         // Next process sleeping in the same wait queue
+
   // these are private to the process, so p->lock need not be held.
   uint64 kstack;               // Virtual address of kernel stack
+  int asid;                    // ASID for the page table, if asidgen is current
+  uint64 asidgen;              // ASID generation asid belongs to (see vm.c)
+  int asidcpu;                 // Hart that last ran the process with asid
   uint64 sz;                   // Size of process memory (bytes)
   pagetable_t pagetable;       // User page table
   struct trapframe *trapframe; // data page for trampoline.S
   struct context context;      // swtch() here to run process
   struct file *ofile[NOFILE];  // Open files
   struct inode *cwd;           // Current directory
+  struct vma vma[NVMA];        // mmap() regions
+  void (*kfn)(void);           // If non-zero, kernel thread's function
   char name[16];               // Process name (debugging)
 };
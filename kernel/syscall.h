@@ -20,3 +20,7 @@
 #define SYS_link   19
 #define SYS_mkdir  20
 #define SYS_close  21
+#define SYS_kstat  22
+#define SYS_mmap   23
+#define SYS_munmap 24
+#define SYS_fsync  25
@@ -119,6 +119,16 @@ sys_fstat(void)
   return filestat(f, st);
 }
 
+uint64
+sys_fsync(void)
+{
+  struct file *f;
+
+  if(argfd(0, 0, &f) < 0)
+    return -1;
+  return filesync(f);
+}
+
 // Create the path new as a link to the same inode as old.
 uint64
 sys_link(void)
@@ -220,6 +230,7 @@ sys_unlink(void)
   }
 
   memset(&de, 0, sizeof(de));
+  dcacheforget(dp, name);
   if(writei(dp, 0, (uint64)&de, off, sizeof(de)) != sizeof(de))
     panic("unlink: writei");
   if(ip->type == T_DIR){
@@ -341,6 +352,13 @@ sys_open(void)
     return -1;
   }
 
+  // a running program pages its image in from ip.
+  if((omode & O_TRUNC) && ip->ntext > 0){
+    iunlockput(ip);
+    end_op();
+    return -1;
+  }
+
   if((f = filealloc()) == 0 || (fd = fdalloc(f)) < 0){
     if(f)
       fileclose(f);
@@ -355,6 +373,9 @@ sys_open(void)
   } else {
     f->type = FD_INODE;
     f->off = 0;
+    f->raoff = 0;
+    f->rawin = 0;
+    f->ranext = 0;
   }
   f->ip = ip;
   f->readable = !(omode & O_WRONLY);
@@ -503,3 +524,31 @@ sys_pipe(void)
   }
   return 0;
 }
+
+// Map a file into memory. The address hint is ignored:
+// the kernel picks the address.
+uint64
+sys_mmap(void)
+{
+  uint64 len;
+  int prot, flags, off;
+  struct file *f;
+
+  argaddr(1, &len);
+  argint(2, &prot);
+  argint(3, &flags);
+  argint(5, &off);
+  if(argfd(4, 0, &f) < 0)
+    return -1;
+  return mmap(len, prot, flags, f, off);
+}
+
+uint64
+sys_munmap(void)
+{
+  uint64 addr, len;
+
+  argaddr(0, &addr);
+  argaddr(1, &len);
+  return munmap(addr, len);
+}
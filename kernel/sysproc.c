@@ -5,6 +5,7 @@
 #include "memlayout.h"
 #include "spinlock.h"
 #include "proc.h"
+#include "kstat.h"
 
 uint64
 sys_exit(void)
@@ -89,3 +90,19 @@ sys_uptime(void)
   release(&tickslock);
   return xticks;
 }
+
+// return kernel statistics.
+uint64
+sys_kstat(void)
+{
+  uint64 addr;
+  struct kstat st;
+
+  argaddr(0, &addr);
+  bstats(&st);
+  virtio_disk_stats(&st);
+  idlestats(&st);
+  if(copyout(myproc()->pagetable, addr, (char *)&st, sizeof(st)) < 0)
+    return -1;
+  return 0;
+}
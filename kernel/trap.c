@@ -16,6 +16,10 @@ void kernelvec();
 
 extern int devintr();
 
+// in start.c; timer_scratch[hart][6] is set by timervec
+// for each timer interrupt.
+extern uint64 timer_scratch[NCPU][7];
+
 void
 trapinit(void)
 {
@@ -67,6 +71,16 @@ usertrap(void)
     syscall();
   } else if((which_dev = devintr()) != 0){
     // ok
+  } else if((r_scause() == 12 || r_scause() == 13 || r_scause() == 15) &&
+            vmfault(p->pagetable, r_stval(), r_scause() == 15, r_scause() == 12) != 0){
+    // page fault on a lazily-allocated, demand-paged or
+    // copy-on-write page, which is now mapped; retry the
+    // instruction.
+  } else if((r_scause() == 12 || r_scause() == 13 || r_scause() == 15) &&
+            vmfaultoom(p->pagetable, r_stval(), r_scause() == 15, r_scause() == 12)){
+    // sbrk() promised the page, but there is no memory for it.
+    printf("usertrap(): out of memory pid=%d va=%p\n", p->pid, r_stval());
+    setkilled(p);
   } else {
     printf("usertrap(): unexpected scause %p pid=%d\n", r_scause(), p->pid);
     printf("            sepc=%p stval=%p\n", r_sepc(), r_stval());
@@ -120,7 +134,7 @@ usertrapret(void)
   w_sepc(p->trapframe->epc);
 
   // tell trampoline.S the user page table to switch to.
-  uint64 satp = MAKE_SATP(p->pagetable);
+  uint64 satp = uvmsatp(p);
 
   // jump to userret in trampoline.S at the top of memory, which 
   // switches to the user page table, restores user registers,
@@ -163,10 +177,15 @@ kerneltrap()
 void
 clockintr()
 {
+  int flush;
+
   acquire(&tickslock);
   ticks++;
   wakeup(&ticks);
+  flush = ticks % FLUSHTICKS == 0;
   release(&tickslock);
+  if(flush)
+    bflushtick();
 }
 
 // check if it's an external interrupt or software interrupt,
@@ -203,16 +222,21 @@ devintr()
     return 1;
   } else if(scause == 0x8000000000000001L){
     // software interrupt from a machine-mode timer interrupt,
+    // or from another hart waking this one with kick(),
     // forwarded by timervec in kernelvec.S.
+    int id = cpuid();
 
-    if(cpuid() == 0){
-      clockintr();
-    }
-    
     // acknowledge the software interrupt by clearing
     // the SSIP bit in sip.
     w_sip(r_sip() & ~2);
 
+    if(__sync_lock_test_and_set(&timer_scratch[id][6], 0) == 0)
+      return 1;  // just a kick.
+
+    if(id == 0){
+      clockintr();
+    }
+
     return 2;
   } else {
     return 0;
@@ -47,7 +47,10 @@
 
 // this many virtio descriptors.
 // must be a power of two.
-#define NUM 8
+// a request for k blocks uses k+2, so at least NUM/3
+// requests can be in flight at once (see NDISKQ in param.h),
+// and a request for NCLUSTER blocks always fits.
+#define NUM 32
 
 // a single descriptor, from the spec.
 struct virtq_desc {
@@ -3,18 +3,47 @@
 #include "memlayout.h"
 #include "elf.h"
 #include "riscv.h"
+#include "spinlock.h"
+#include "proc.h"
 #include "defs.h"
 #include "fs.h"
+#include "fcntl.h"
 
 /*
  * the kernel's page table.
  */
 pagetable_t kernel_pagetable;
 
+// User address spaces are tagged with address space IDs
+// (ASIDs), so that the TLB can keep the entries of the kernel
+// (ASID 0) and of several processes at once, and a process's
+// entries survive its traps and system calls.
+//
+// ASIDs are handed out in order. When they run out, a new
+// generation starts: every process must get a new ASID, and
+// every hart must flush its TLB before using any of them.
+// A process that changes its page table so as to take away
+// access drops its ASID (asidretire()), abandoning any
+// entries for the old mappings in the TLBs of every hart it
+// has run on; changes that only add access are flushed from
+// the local TLB by va (asidflush()).
+//
+// If the hardware has no ASIDs, trampoline.S flushes the
+// whole TLB on every switch between kernel and user.
+struct {
+  struct spinlock lock;
+  uint64 gen;   // current generation
+  int next;     // next ASID to hand out
+  int max;      // number of ASIDs, 0 if none
+} asid = { .gen = 1, .next = 1 };
+
 extern char etext[];  // kernel.ld sets this to end of kernel code.
 
 extern char trampoline[]; // trampoline.S
 
+static int uvmcow(pagetable_t, uint64);
+static pte_t *walklevel(pagetable_t, uint64, int, int);
+
 // Make a direct-map page table for the kernel.
 pagetable_t
 kvmmake(void)
@@ -30,6 +59,9 @@ kvmmake(void)
   // virtio mmio disk interface
   kvmmap(kpgtbl, VIRTIO0, VIRTIO0, PGSIZE, PTE_R | PTE_W);
 
+  // CLINT, to interrupt other harts and read the time
+  kvmmap(kpgtbl, CLINT, CLINT, 0x10000, PTE_R | PTE_W);
+
   // PLIC
   kvmmap(kpgtbl, PLIC, PLIC, 0x400000, PTE_R | PTE_W);
 
@@ -54,6 +86,7 @@ void
 kvminit(void)
 {
   kernel_pagetable = kvmmake();
+  initlock(&asid.lock, "asid");
 }
 
 // Switch h/w page table register to the kernel's page table,
@@ -61,15 +94,90 @@ kvminit(void)
 void
 kvminithart()
 {
+  uint64 satp;
+
   // wait for any previous writes to the page table memory to finish.
   sfence_vma();
 
+  // find out how many ASID bits the hardware has, by
+  // writing ones to satp's ASID field and reading them back.
+  w_satp(MAKE_SATP(kernel_pagetable) | SATP_ASIDMASK);
+  satp = r_satp() & SATP_ASIDMASK;
+  asid.max = satp ? (satp >> 44) + 1 : 0;
+
+  // the kernel runs with ASID 0.
   w_satp(MAKE_SATP(kernel_pagetable));
 
   // flush stale entries from the TLB.
   sfence_vma();
 }
 
+// Return the satp value for p's page table, giving p an
+// ASID first if it has none from the current generation.
+// Called by usertrapret() with interrupts off.
+uint64
+uvmsatp(struct proc *p)
+{
+  struct cpu *c = mycpu();
+  uint64 gen;
+
+  if(asid.max == 0)
+    return MAKE_SATP(p->pagetable);
+
+  gen = __atomic_load_n(&asid.gen, __ATOMIC_ACQUIRE);
+  if(p->asidgen != gen || c->asidgen != gen){
+    acquire(&asid.lock);
+    if(p->asidgen != asid.gen){
+      if(asid.next == asid.max){
+        asid.gen++;
+        asid.next = 1;
+      }
+      p->asid = asid.next++;
+      p->asidgen = asid.gen;
+      p->asidcpu = c - cpus;
+    }
+    gen = asid.gen;
+    release(&asid.lock);
+    if(c->asidgen != gen){
+      // this hart may hold entries for ASIDs from an old
+      // generation that the new one hands out again.
+      sfence_vma();
+      c->asidgen = gen;
+    }
+  }
+  if(p->asidcpu != c - cpus){
+    // this hart may hold entries for p from an earlier
+    // run here, made stale by changes that asidflush()
+    // flushed only from the harts p ran on since.
+    sfence_vma_asid(p->asid);
+    p->asidcpu = c - cpus;
+  }
+  return MAKE_SATP(p->pagetable) | SATP_ASID(p->asid);
+}
+
+// p's page table no longer allows some access it did:
+// drop p's ASID, and with it any TLB entries for the old
+// mappings. p gets a new ASID on its way back to user space.
+void
+asidretire(struct proc *p)
+{
+  p->asidgen = 0;
+}
+
+// The current process's page table now allows more access
+// to va than it did, or maps it to a private copy of a
+// copy-on-write page; flush a stale entry for va from this
+// hart's TLB. Other harts' entries for the process go when
+// it next runs there (see uvmsatp()).
+static void
+asidflush(uint64 va)
+{
+  struct proc *p = myproc();
+
+  if(asid.max != 0 && p->asidgen == __atomic_load_n(&asid.gen, __ATOMIC_ACQUIRE))
+    sfence_vma_page(va, p->asid);
+}
+
 // Return the address of the PTE in page table pagetable
 // that corresponds to virtual address va.  If alloc!=0,
 // create any required page-table pages.
@@ -82,15 +190,29 @@ kvminithart()
 //   21..29 -- 9 bits of level-1 index.
 //   12..20 -- 9 bits of level-0 index.
 //    0..11 -- 12 bits of byte offset within the page.
+//
+// A leaf PTE at level 1 or 2 maps a whole megapage or
+// gigapage; if one covers va, return it. Only the kernel
+// page table has them; user page tables map 4096-byte pages.
 pte_t *
 walk(pagetable_t pagetable, uint64 va, int alloc)
+{
+  return walklevel(pagetable, va, alloc, 0);
+}
+
+// Like walk(), but return the PTE for va at the given
+// level, to map a page of LEVELSIZE(level) bytes.
+static pte_t *
+walklevel(pagetable_t pagetable, uint64 va, int alloc, int level)
 {
   if(va >= MAXVA)
     panic("walk");
 
-  for(int level = 2; level > 0; level--) {
-    pte_t *pte = &pagetable[PX(level, va)];
+  for(int l = 2; l > level; l--) {
+    pte_t *pte = &pagetable[PX(l, va)];
     if(*pte & PTE_V) {
+      if(PTE_LEAF(*pte))
+        return pte;
       pagetable = (pagetable_t)PTE2PA(*pte);
     } else {
       if(!alloc || (pagetable = (pde_t*)kalloc()) == 0)
@@ -99,7 +221,7 @@ walk(pagetable_t pagetable, uint64 va, int alloc)
       *pte = PA2PTE(pagetable) | PTE_V;
     }
   }
-  return &pagetable[PX(0, va)];
+  return &pagetable[PX(level, va)];
 }
 
 // Look up a virtual address, return the physical address,
@@ -137,13 +259,17 @@ kvmmap(pagetable_t kpgtbl, uint64 va, uint64 pa, uint64 sz, int perm)
 
 // Create PTEs for virtual addresses starting at va that refer to
 // physical addresses starting at pa. va and size might not
-// be page-aligned. Returns 0 on success, -1 if walk() couldn't
+// be page-aligned. Where va, pa and the remaining size allow,
+// use a megapage or gigapage PTE; the user page tables map
+// only a page at a time, so they never get one.
+// Returns 0 on success, -1 if walk() couldn't
 // allocate a needed page-table page.
 int
 mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
 {
-  uint64 a, last;
+  uint64 a, last, sz;
   pte_t *pte;
+  int level;
 
   if(size == 0)
     panic("mappages: size");
@@ -151,21 +277,28 @@ mappages(pagetable_t pagetable, uint64 va, uint64 size, uint64 pa, int perm)
   a = PGROUNDDOWN(va);
   last = PGROUNDDOWN(va + size - 1);
   for(;;){
-    if((pte = walk(pagetable, a, 1)) == 0)
+    for(level = 2; level > 0; level--){
+      sz = LEVELSIZE(level);
+      if(a % sz == 0 && pa % sz == 0 && last - a >= sz - PGSIZE)
+        break;
+    }
+    sz = LEVELSIZE(level);
+    if((pte = walklevel(pagetable, a, 1, level)) == 0)
       return -1;
     if(*pte & PTE_V)
       panic("mappages: remap");
     *pte = PA2PTE(pa) | perm | PTE_V;
-    if(a == last)
+    if(last - a < sz)
       break;
-    a += PGSIZE;
-    pa += PGSIZE;
+    a += sz;
+    pa += sz;
   }
   return 0;
 }
 
 // Remove npages of mappings starting from va. va must be
-// page-aligned. The mappings must exist.
+// page-aligned. Pages that were never faulted in (see
+// vmfault()) are skipped.
 // Optionally free the physical memory.
 void
 uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
@@ -177,10 +310,8 @@ uvmunmap(pagetable_t pagetable, uint64 va, uint64 npages, int do_free)
     panic("uvmunmap: not aligned");
 
   for(a = va; a < va + npages*PGSIZE; a += PGSIZE){
-    if((pte = walk(pagetable, a, 0)) == 0)
-      panic("uvmunmap: walk");
-    if((*pte & PTE_V) == 0)
-      panic("uvmunmap: not mapped");
+    if((pte = walk(pagetable, a, 0)) == 0 || (*pte & PTE_V) == 0)
+      continue;
     if(PTE_FLAGS(*pte) == PTE_V)
       panic("uvmunmap: not a leaf");
     if(do_free){
@@ -297,41 +428,162 @@ uvmfree(pagetable_t pagetable, uint64 sz)
 }
 
 // Given a parent process's page table, copy
-// its memory into a child's page table.
-// Copies both the page table and the
-// physical memory.
+// its memory from start to end into a child's page table.
+// Pages the parent has not yet faulted in stay
+// unmapped in the child too.
+// The child shares the parent's physical pages:
+// unless share is set, as for a MAP_SHARED mapping,
+// writable pages are made read-only and marked
+// copy-on-write in both page tables, and uvmcow()
+// copies them when either process writes.
 // returns 0 on success, -1 on failure.
 // frees any allocated pages on failure.
 int
-uvmcopy(pagetable_t old, pagetable_t new, uint64 sz)
+uvmcopy(pagetable_t old, pagetable_t new, uint64 start, uint64 end, int share)
 {
   pte_t *pte;
   uint64 pa, i;
   uint flags;
-  char *mem;
 
-  for(i = 0; i < sz; i += PGSIZE){
-    if((pte = walk(old, i, 0)) == 0)
-      panic("uvmcopy: pte should exist");
-    if((*pte & PTE_V) == 0)
-      panic("uvmcopy: page not present");
+  for(i = start; i < end; i += PGSIZE){
+    if((pte = walk(old, i, 0)) == 0 || (*pte & PTE_V) == 0)
+      continue;
+    if(!share && (*pte & PTE_W))
+      *pte = (*pte & ~PTE_W) | PTE_COW;
     pa = PTE2PA(*pte);
-    flags = PTE_FLAGS(*pte);
-    if((mem = kalloc()) == 0)
-      goto err;
-    memmove(mem, (char*)pa, PGSIZE);
-    if(mappages(new, i, PGSIZE, (uint64)mem, flags) != 0){
-      kfree(mem);
+    // the child has yet to write to the page itself.
+    flags = PTE_FLAGS(*pte) & ~PTE_D;
+    if(mappages(new, i, PGSIZE, pa, flags) != 0)
       goto err;
-    }
+    krefinc((void*)pa);
   }
   return 0;
 
  err:
-  uvmunmap(new, 0, i / PGSIZE, 1);
+  uvmunmap(new, start, (i - start) / PGSIZE, 1);
   return -1;
 }
 
+// Resolve a write to the copy-on-write page at va:
+// give the page table a private, writable copy of the page,
+// or just make the page writable if no one else shares it.
+// The caller flushes the TLB entry for va.
+// Returns 0 on success, -1 if va is not a copy-on-write page
+// or there is no memory for the copy.
+static int
+uvmcow(pagetable_t pagetable, uint64 va)
+{
+  pte_t *pte;
+  uint64 pa;
+  uint flags;
+  char *mem;
+
+  if(va >= MAXVA)
+    return -1;
+  pte = walk(pagetable, va, 0);
+  if(pte == 0)
+    return -1;
+  if((*pte & PTE_V) == 0 || (*pte & PTE_U) == 0 || (*pte & PTE_COW) == 0)
+    return -1;
+  pa = PTE2PA(*pte);
+  flags = (PTE_FLAGS(*pte) | PTE_W) & ~PTE_COW;
+
+  if(krefcnt((void*)pa) == 1){
+    // last reference; no need to copy.
+    *pte = PA2PTE(pa) | flags;
+    return 0;
+  }
+
+  if((mem = kalloc()) == 0)
+    return -1;
+  memmove(mem, (char*)pa, PGSIZE);
+  *pte = PA2PTE(mem) | flags;
+  kfree((void*)pa);
+  return 0;
+}
+
+// Handle a page fault at va in the current process.
+// sbrk() only grows p->sz, so the first touch of a heap
+// page lands here and gets a freshly zeroed page; the first
+// touch of a page of an mmap() region, or of a program
+// that exec() loads on demand, maps the file's page;
+// a write to a copy-on-write page gets a private copy.
+// write or exec says the fault was a store or an
+// instruction fetch, which the page must allow.
+// Also called by copyin() and copyout().
+// Returns the physical address of the page, or 0 if va
+// is not a valid address or there is no memory.
+uint64
+vmfault(pagetable_t pagetable, uint64 va, int write, int exec)
+{
+  struct proc *p = myproc();
+  pte_t *pte;
+  char *mem;
+
+  va = PGROUNDDOWN(va);
+  if(va >= MAXVA)
+    return 0;
+
+  pte = walk(pagetable, va, 0);
+  if(pte && (*pte & PTE_V)){
+    // the page is there; a copy-on-write store can succeed,
+    // or the fault came from a stale TLB entry.
+    if(write && (*pte & PTE_COW)){
+      if(uvmcow(pagetable, va) != 0)
+        return 0;
+    } else if((*pte & PTE_U) == 0 || (*pte & (write ? PTE_W : exec ? PTE_X : PTE_R)) == 0){
+      return 0;
+    }
+    if(p && pagetable == p->pagetable)
+      asidflush(va);
+    return PTE2PA(*pte);
+  }
+
+  if(p == 0 || pagetable != p->pagetable)
+    return 0;
+  if(vmafind(p, va)){
+    if(vmafault(p, va, exec) != 0)
+      return 0;
+    // now the page is there; check the access, and copy
+    // a MAP_PRIVATE page for a write.
+    return vmfault(pagetable, va, write, exec);
+  }
+  // heap pages aren't executable.
+  if(va >= p->sz || exec)
+    return 0;
+  if((mem = kalloc()) == 0)
+    return 0;
+  memset(mem, 0, PGSIZE);
+  if(mappages(pagetable, va, PGSIZE, (uint64)mem, PTE_W|PTE_R|PTE_U) != 0){
+    kfree(mem);
+    return 0;
+  }
+  asidflush(va);
+  return (uint64)mem;
+}
+
+// vmfault() failed at va. Was it for want of memory, rather
+// than because the process may not access va? True if va is
+// a page the process may use that isn't mapped yet, or a
+// copy-on-write page that a store must copy.
+int
+vmfaultoom(pagetable_t pagetable, uint64 va, int write, int exec)
+{
+  struct proc *p = myproc();
+  struct vma *v;
+  pte_t *pte;
+
+  va = PGROUNDDOWN(va);
+  if(va >= MAXVA)
+    return 0;
+  pte = walk(pagetable, va, 0);
+  if(pte && (*pte & PTE_V))
+    return write && (*pte & PTE_COW);
+  if((v = vmafind(p, va)) != 0)
+    return v->prot != PROT_NONE && (!exec || (v->prot & PROT_EXEC));
+  return va < p->sz && !exec;
+}
+
 // mark a PTE invalid for user access.
 // used by exec for the user stack guard page.
 void
@@ -345,28 +597,71 @@ uvmclear(pagetable_t pagetable, uint64 va)
   *pte &= ~PTE_U;
 }
 
+// Return the PTE of user page va for copying to it (write)
+// or from it, first faulting in a lazily-allocated or
+// copy-on-write page. Returns 0 if the copy may not use va.
+// prev is 0, or the PTE of the page just below va; when both
+// are in the same page-table page, step to the next PTE rather
+// than walk the page table again.
+static pte_t *
+copypte(pagetable_t pagetable, uint64 va, int write, pte_t *prev)
+{
+  pte_t *pte;
+
+  if(va >= MAXVA)
+    return 0;
+  if(prev && PX(0, va) != 0)
+    pte = prev + 1;
+  else
+    pte = walk(pagetable, va, 0);
+  if(pte == 0 || (*pte & PTE_V) == 0 || (write && (*pte & PTE_COW))){
+    if(vmfault(pagetable, va, write, 0) == 0)
+      return 0;
+    pte = walk(pagetable, va, 0);
+  }
+  if((*pte & PTE_U) == 0 || (write && (*pte & PTE_W) == 0))
+    return 0;
+  // the kernel's stores, through its own mapping of the
+  // page, don't mark the user PTE dirty; munmap() must see them.
+  if(write)
+    *pte |= PTE_D;
+  return pte;
+}
+
 // Copy from kernel to user.
 // Copy len bytes from src to virtual address dstva in a given page table.
+// Pages that are physically contiguous, as they often are,
+// are copied with a single memmove().
 // Return 0 on success, -1 on error.
 int
 copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 {
-  uint64 n, va0, pa0;
+  uint64 n, va0, pa, runpa, runlen;
+  pte_t *pte = 0;
 
+  runpa = runlen = 0;
   while(len > 0){
     va0 = PGROUNDDOWN(dstva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if((pte = copypte(pagetable, va0, 1, pte)) == 0)
       return -1;
+    pa = PTE2PA(*pte) + (dstva - va0);
     n = PGSIZE - (dstva - va0);
     if(n > len)
       n = len;
-    memmove((void *)(pa0 + (dstva - va0)), src, n);
+    if(runlen > 0 && pa != runpa + runlen){
+      memmove((void *)runpa, src, runlen);
+      src += runlen;
+      runlen = 0;
+    }
+    if(runlen == 0)
+      runpa = pa;
+    runlen += n;
 
     len -= n;
-    src += n;
     dstva = va0 + PGSIZE;
   }
+  if(runlen > 0)
+    memmove((void *)runpa, src, runlen);
   return 0;
 }
 
@@ -376,22 +671,32 @@ copyout(pagetable_t pagetable, uint64 dstva, char *src, uint64 len)
 int
 copyin(pagetable_t pagetable, char *dst, uint64 srcva, uint64 len)
 {
-  uint64 n, va0, pa0;
+  uint64 n, va0, pa, runpa, runlen;
+  pte_t *pte = 0;
 
+  runpa = runlen = 0;
   while(len > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if((pte = copypte(pagetable, va0, 0, pte)) == 0)
       return -1;
+    pa = PTE2PA(*pte) + (srcva - va0);
     n = PGSIZE - (srcva - va0);
     if(n > len)
       n = len;
-    memmove(dst, (void *)(pa0 + (srcva - va0)), n);
+    if(runlen > 0 && pa != runpa + runlen){
+      memmove(dst, (void *)runpa, runlen);
+      dst += runlen;
+      runlen = 0;
+    }
+    if(runlen == 0)
+      runpa = pa;
+    runlen += n;
 
     len -= n;
-    dst += n;
     srcva = va0 + PGSIZE;
   }
+  if(runlen > 0)
+    memmove(dst, (void *)runpa, runlen);
   return 0;
 }
 
@@ -404,12 +709,13 @@ copyinstr(pagetable_t pagetable, char *dst, uint64 srcva, uint64 max)
 {
   uint64 n, va0, pa0;
   int got_null = 0;
+  pte_t *pte = 0;
 
   while(got_null == 0 && max > 0){
     va0 = PGROUNDDOWN(srcva);
-    pa0 = walkaddr(pagetable, va0);
-    if(pa0 == 0)
+    if((pte = copypte(pagetable, va0, 0, pte)) == 0)
       return -1;
+    pa0 = PTE2PA(*pte);
     n = PGSIZE - (srcva - va0);
     if(n > max)
       n = max;
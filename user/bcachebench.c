@@ -0,0 +1,115 @@
+// Measure buffer cache contention.
+// Each of nchild processes repeatedly opens and reads its
+// own small file. The files fit in the buffer cache, so
+// the run time is dominated by bget()/brelse() locking.
+// Compare runs with CPUS=1 and CPUS=8:
+//   $ bcachebench 8
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "kernel/fs.h"
+#include "kernel/fcntl.h"
+#include "user/user.h"
+
+#define NBLOCK 3     // blocks per file
+#define ROUNDS 400
+
+char buf[BSIZE];
+
+void
+makefile(char *name)
+{
+  int fd, i;
+
+  unlink(name);
+  fd = open(name, O_CREATE | O_WRONLY);
+  if(fd < 0){
+    printf("bcachebench: create %s failed\n", name);
+    exit(1);
+  }
+  for(i = 0; i < NBLOCK; i++){
+    if(write(fd, buf, BSIZE) != BSIZE){
+      printf("bcachebench: write %s failed\n", name);
+      exit(1);
+    }
+  }
+  close(fd);
+}
+
+void
+readloop(char *name)
+{
+  int fd, r, n, tot;
+
+  for(r = 0; r < ROUNDS; r++){
+    fd = open(name, O_RDONLY);
+    if(fd < 0){
+      printf("bcachebench: open %s failed\n", name);
+      exit(1);
+    }
+    tot = 0;
+    while((n = read(fd, buf, BSIZE)) > 0)
+      tot += n;
+    close(fd);
+    if(tot != NBLOCK*BSIZE){
+      printf("bcachebench: short read of %s\n", name);
+      exit(1);
+    }
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  char name[8];
+  int nchild, i, pid, xstatus, t0, t1;
+
+  nchild = 4;
+  if(argc > 1)
+    nchild = atoi(argv[1]);
+  if(nchild < 1 || nchild > 10){
+    fprintf(2, "usage: bcachebench [nchild (1-10)]\n");
+    exit(1);
+  }
+
+  name[0] = 'b';
+  name[1] = 'c';
+  name[3] = '\0';
+  for(i = 0; i < nchild; i++){
+    name[2] = '0' + i;
+    makefile(name);
+  }
+
+  t0 = uptime();
+  for(i = 0; i < nchild; i++){
+    name[2] = '0' + i;
+    pid = fork();
+    if(pid < 0){
+      printf("bcachebench: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      readloop(name);
+      exit(0);
+    }
+  }
+  for(i = 0; i < nchild; i++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(1);
+  }
+  t1 = uptime();
+
+  for(i = 0; i < nchild; i++){
+    name[2] = '0' + i;
+    unlink(name);
+  }
+
+  int blocks = nchild * ROUNDS * NBLOCK;
+  int ticks = t1 - t0;
+  if(ticks == 0)
+    ticks = 1;
+  printf("bcachebench: %d procs, %d block reads in %d ticks, %d reads/tick\n",
+         nchild, blocks, t1 - t0, blocks / ticks);
+  exit(0);
+}
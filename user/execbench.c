@@ -0,0 +1,59 @@
+// Measure how long fork() and exec() of a program take.
+// Runs the program n times, each time with -h, so that it
+// exits as soon as it starts, and reports the ticks per run.
+// A run that doesn't exit with status 0 is an error. With no
+// program named, runs usertests, which is big enough to be
+// paged in on demand:
+//   $ execbench 100
+//   $ execbench 100 echo
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+int
+main(int argc, char *argv[])
+{
+  int n, i, pid, xstatus, t0, t1;
+  char *prog, *args[3];
+
+  n = 50;
+  prog = "usertests";
+  if(argc > 1)
+    n = atoi(argv[1]);
+  if(argc > 2)
+    prog = argv[2];
+  if(n < 1){
+    fprintf(2, "usage: execbench [n] [program]\n");
+    exit(1);
+  }
+  args[0] = prog;
+  args[1] = "-h";
+  args[2] = 0;
+
+  t0 = uptime();
+  for(i = 0; i < n; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("execbench: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      close(1);
+      exec(prog, args);
+      fprintf(2, "execbench: exec %s failed\n", prog);
+      exit(1);
+    }
+    wait(&xstatus);
+    if(xstatus != 0){
+      fprintf(2, "execbench: %s exited with status %d\n", prog, xstatus);
+      exit(1);
+    }
+  }
+  t1 = uptime();
+
+  printf("execbench: %d runs of %s in %d ticks, %d.%d%d ticks/run\n",
+         n, prog, t1 - t0, (t1 - t0) / n, (t1 - t0) * 10 / n % 10,
+         (t1 - t0) * 100 / n % 10);
+  exit(0);
+}
@@ -0,0 +1,76 @@
+// Measure kalloc()/kfree() throughput.
+// Forks nchild processes that repeatedly grow their heap,
+// touch every new page, and shrink it again, then reports
+// how many pages per tick the kernel allocated and freed.
+// Run with different CPUS= settings to see how the page
+// allocator scales:
+//   $ kallocbench 8
+
+#include "kernel/types.h"
+#include "kernel/stat.h"
+#include "user/user.h"
+
+#define NPAGE  64    // pages per round
+#define ROUNDS 200
+
+void
+churn(void)
+{
+  char *a;
+  int i, r;
+
+  for(r = 0; r < ROUNDS; r++){
+    a = sbrk(NPAGE*4096);
+    if(a == (char*)-1){
+      printf("kallocbench: sbrk failed\n");
+      exit(1);
+    }
+    for(i = 0; i < NPAGE; i++)
+      a[i*4096] = r;
+    if(sbrk(-NPAGE*4096) == (char*)-1){
+      printf("kallocbench: sbrk shrink failed\n");
+      exit(1);
+    }
+  }
+}
+
+int
+main(int argc, char *argv[])
+{
+  int nchild, i, pid, xstatus, t0, t1;
+
+  nchild = 4;
+  if(argc > 1)
+    nchild = atoi(argv[1]);
+  if(nchild < 1){
+    fprintf(2, "usage: kallocbench [nchild]\n");
+    exit(1);
+  }
+
+  t0 = uptime();
+  for(i = 0; i < nchild; i++){
+    pid = fork();
+    if(pid < 0){
+      printf("kallocbench: fork failed\n");
+      exit(1);
+    }
+    if(pid == 0){
+      churn();
+      exit(0);
+    }
+  }
+  for(i = 0; i < nchild; i++){
+    wait(&xstatus);
+    if(xstatus != 0)
+      exit(1);
+  }
+  t1 = uptime();
+
+  int pages = nchild * ROUNDS * NPAGE;
+  int ticks = t1 - t0;
+  if(ticks == 0)
+    ticks = 1;
+  printf("kallocbench: %d procs, %d pages in %d ticks, %d pages/tick\n",
+         nchild, pages, t1 - t0, pages / ticks);
+  exit(0);
+}
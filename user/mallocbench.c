@@ -0,0 +1,98 @@
+// Measure malloc() and free() throughput, in operations
+// per second (rdtime, 10 MHz in qemu), for a few patterns:
+//   lifo:   allocate and immediately free small blocks.
+//   random: a pool of slots, each step freeing or filling
+//           a random slot with a random small size.
+//   mixed:  like random, but one block in eight is large.
+//   $ mallocbench
+
+#include "kernel/types.h"
+#include "user/user.h"
+
+#define NSLOT 512
+#define NOPS 100000
+
+char *slot[NSLOT];
+static uint seed = 1;
+
+static uint
+rand(void)
+{
+  seed = seed * 1103515245 + 12345;
+  return seed >> 8;
+}
+
+static uint64
+rdtime(void)
+{
+  uint64 x;
+  asm volatile("rdtime %0" : "=r" (x));
+  return x;
+}
+
+void
+report(char *what, uint64 t0)
+{
+  uint64 t = rdtime() - t0;
+
+  if(t == 0)
+    t = 1;
+  printf("%s: %l ops/sec\n", what, (uint64)NOPS * 10000000 / t);
+}
+
+void
+lifo(void)
+{
+  int i;
+  char *p;
+  uint64 t0 = rdtime();
+
+  for(i = 0; i < NOPS/2; i++){
+    if((p = malloc(16 + i % 200)) == 0){
+      fprintf(2, "mallocbench: out of memory\n");
+      exit(1);
+    }
+    p[0] = 1;
+    free(p);
+  }
+  report("lifo", t0);
+}
+
+void
+pool(char *what, int bigevery)
+{
+  int i, s;
+  uint n;
+  uint64 t0 = rdtime();
+
+  for(i = 0; i < NOPS; i++){
+    s = rand() % NSLOT;
+    if(slot[s]){
+      free(slot[s]);
+      slot[s] = 0;
+    } else {
+      n = 8 + rand() % 256;
+      if(bigevery && rand() % bigevery == 0)
+        n = 2048 + rand() % 8192;
+      if((slot[s] = malloc(n)) == 0){
+        fprintf(2, "mallocbench: out of memory\n");
+        exit(1);
+      }
+      slot[s][0] = 1;
+    }
+  }
+  for(s = 0; s < NSLOT; s++){
+    free(slot[s]);
+    slot[s] = 0;
+  }
+  report(what, t0);
+}
+
+int
+main(void)
+{
+  lifo();
+  pool("random", 0);
+  pool("mixed", 8);
+  exit(0);
+}
@@ -0,0 +1,120 @@
+// Measure the kernel's memory copy and fill speed,
+// in bytes per 1000 cycles (rdcycle) and per
+// microsecond (rdtime, 10 MHz in qemu).
+// Reading a cached file exercises copyout()'s memmove()
+// from the buffer cache, to a word-aligned buffer and
+// to a misaligned one; growing and shrinking memory
+// exercises kalloc()'s and kfree()'s memset().
+//   $ membench
+
+#include "kernel/types.h"
+#include "kernel/fcntl.h"
+#include "kernel/riscv.h"
+#include "user/user.h"
+
+#define FILESZ (32*1024)   // fits in the buffer cache
+#define ROUNDS 64
+#define NPAGE 256
+
+char buf[PGSIZE + 8];
+
+static uint64
+rdcycle(void)
+{
+  uint64 x;
+  asm volatile("rdcycle %0" : "=r" (x));
+  return x;
+}
+
+static uint64
+rdtime(void)
+{
+  uint64 x;
+  asm volatile("rdtime %0" : "=r" (x));
+  return x;
+}
+
+void
+report(char *what, uint64 bytes, uint64 c0, uint64 t0)
+{
+  uint64 cycles = rdcycle() - c0;
+  uint64 time = rdtime() - t0;
+
+  if(cycles == 0)
+    cycles = 1;
+  if(time == 0)
+    time = 1;
+  printf("%s: %l bytes/kcycle, %l bytes/us\n",
+         what, bytes * 1000 / cycles, bytes * 10 / time);
+}
+
+void
+readbench(char *what, char *dst)
+{
+  int fd, i, n;
+  uint64 c0, t0, bytes = 0;
+
+  c0 = rdcycle();
+  t0 = rdtime();
+  for(i = 0; i < ROUNDS; i++){
+    if((fd = open("membench.tmp", O_RDONLY)) < 0){
+      fprintf(2, "membench: open failed\n");
+      exit(1);
+    }
+    while((n = read(fd, dst, PGSIZE)) > 0)
+      bytes += n;
+    close(fd);
+  }
+  report(what, bytes, c0, t0);
+}
+
+void
+sbrkbench(void)
+{
+  char *a;
+  int i, j;
+  uint64 c0, t0;
+
+  c0 = rdcycle();
+  t0 = rdtime();
+  for(i = 0; i < ROUNDS; i++){
+    a = sbrk(NPAGE*PGSIZE);
+    if(a == (char*)-1){
+      fprintf(2, "membench: sbrk failed\n");
+      exit(1);
+    }
+    for(j = 0; j < NPAGE; j++)
+      a[j*PGSIZE] = 1;
+    sbrk(-(NPAGE*PGSIZE));
+  }
+  // each page is zeroed by kalloc() and junk-filled by kfree().
+  report("page fill", (uint64)ROUNDS*NPAGE*PGSIZE*2, c0, t0);
+}
+
+int
+main(void)
+{
+  int fd, i;
+
+  unlink("membench.tmp");
+  fd = open("membench.tmp", O_CREATE | O_WRONLY);
+  if(fd < 0){
+    fprintf(2, "membench: create failed\n");
+    exit(1);
+  }
+  memset(buf, 'x', PGSIZE);
+  for(i = 0; i < FILESZ / PGSIZE; i++){
+    if(write(fd, buf, PGSIZE) != PGSIZE){
+      fprintf(2, "membench: write failed\n");
+      exit(1);
+    }
+  }
+  close(fd);
+
+  readbench("read, aligned", buf);
+  readbench("read, misaligned", buf + 1);
+  sbrkbench();
+
+  unlink("membench.tmp");
+  exit(0);
+}
@@ -1,15 +1,83 @@
 #include "kernel/types.h"
 #include "kernel/stat.h"
+#include "kernel/param.h"
 #include "user/user.h"
 
 #include <stdarg.h>
 
 static char digits[] = "0123456789ABCDEF";
 
+// Output buffers, one per file descriptor.
+// printf() formats into fd's buffer and then, depending on
+// the buffering mode, writes it out with a single write():
+//   _IONBF: at the end of each printf() call.
+//   _IOLBF: at the end of a call that printed a newline.
+//   _IOFBF: only when the buffer fills up.
+// Standard output is line buffered, others unbuffered,
+// until changed with setvbuf().
+// exit(), fork() and exec() flush all buffers first.
+static struct obuf {
+  int mode;
+  int n;
+  int nl;        // newline added since last flush?
+  char buf[BUFSIZ];
+} obuf[NOFILE] = {
+  [1] = { .mode = _IOLBF },
+};
+
+static void
+flush(int fd, struct obuf *b)
+{
+  if(b->n > 0)
+    write(fd, b->buf, b->n);
+  b->n = 0;
+  b->nl = 0;
+}
+
 static void
 putc(int fd, char c)
 {
-  write(fd, &c, 1);
+  struct obuf *b;
+
+  if(fd < 0 || fd >= NOFILE){
+    write(fd, &c, 1);
+    return;
+  }
+  b = &obuf[fd];
+  if(b->n == BUFSIZ)
+    flush(fd, b);
+  b->buf[b->n++] = c;
+  if(c == '\n')
+    b->nl = 1;
+}
+
+// Write out fd's buffered output.
+void
+fflush(int fd)
+{
+  if(fd >= 0 && fd < NOFILE)
+    flush(fd, &obuf[fd]);
+}
+
+// Write out all buffered output.
+void
+flushall(void)
+{
+  int fd;
+
+  for(fd = 0; fd < NOFILE; fd++)
+    flush(fd, &obuf[fd]);
+}
+
+// Set fd's buffering mode to _IONBF, _IOLBF or _IOFBF.
+int
+setvbuf(int fd, int mode)
+{
+  if(fd < 0 || fd >= NOFILE || mode < _IONBF || mode > _IOFBF)
+    return -1;
+  flush(fd, &obuf[fd]);
+  obuf[fd].mode = mode;
+  return 0;
 }
 
 static void
@@ -51,6 +119,8 @@ printptr(int fd, uint64 x) {
 void
 vprintf(int fd, const char *fmt, va_list ap)
 {
+  struct obuf *b;
+
   char *s;
   int c, i, state;
 
@@ -92,6 +162,12 @@ vprintf(int fd, const char *fmt, va_list ap)
       state = 0;
     }
   }
+
+  if(fd >= 0 && fd < NOFILE){
+    b = &obuf[fd];
+    if(b->mode == _IONBF || (b->mode == _IOLBF && b->nl))
+      flush(fd, b);
+  }
 }
 
 void
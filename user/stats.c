@@ -0,0 +1,31 @@
+// Print kernel statistics: the buffer cache and disk counters,
+// and how much of the time since boot each hart has
+// spent idle. Run it before and after a workload:
+//   $ stats; wc README; stats
+
+#include "kernel/param.h"
+#include "kernel/types.h"
+#include "kernel/kstat.h"
+#include "user/user.h"
+
+int
+main(void)
+{
+  struct kstat st;
+  int i;
+
+  if(kstat(&st) < 0){
+    fprintf(2, "stats: kstat failed\n");
+    exit(1);
+  }
+  printf("bread: %l hits, %l misses; %l blocks read ahead\n",
+         st.bhit, st.bmiss, st.bahead);
+  printf("disk: %l requests for %l blocks\n", st.dreq, st.dblocks);
+  for(i = 0; i < NCPU; i++){
+    if(st.idle[i] == 0)
+      continue;
+    printf("hart %d: idle %l%% of %l ms\n", i,
+           st.idle[i] * 100 / st.time, st.time / 10000);
+  }
+  exit(0);
+}
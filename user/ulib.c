@@ -14,6 +14,37 @@ _main()
   exit(0);
 }
 
+// printf.c replaces this with a version that writes out
+// buffered output; programs linked without it have none.
+__attribute__((weak)) void
+flushall(void)
+{
+}
+
+// Write out buffered printf() output before the process
+// exits or execs, and before fork() so that the child
+// doesn't inherit a copy of it and print it again.
+int
+exit(int status)
+{
+  flushall();
+  _exit(status);
+}
+
+int
+fork(void)
+{
+  flushall();
+  return _fork();
+}
+
+int
+exec(const char *path, char **argv)
+{
+  flushall();
+  return _exec(path, argv);
+}
+
 char*
 strcpy(char *s, const char *t)
 {
@@ -3,8 +3,18 @@
 #include "user/user.h"
 #include "kernel/param.h"
 
-// Memory allocator by Kernighan and Ritchie,
-// The C programming Language, 2nd ed.  Section 8.7.
+// Memory allocator.
+//
+// Small requests come from segregated size classes: blocks
+// of 32, 64, ..., 1024 bytes including the header, each class
+// with its own free list, so malloc() and free() take
+// constant time. A class that runs out carves up a chunk
+// from the large-block allocator, and its blocks stay in
+// the class once freed.
+//
+// Larger requests, and the chunks, use the allocator by
+// Kernighan and Ritchie, The C programming Language,
+// 2nd ed.  Section 8.7.
 
 typedef long Align;
 
@@ -21,8 +31,15 @@ typedef union header Header;
 static Header base;
 static Header *freep;
 
-void
-free(void *ap)
+#define NCLASS 6
+#define CLASSSZ(c) (32 << (c))   // block size in bytes, with header
+#define SMALL 0x80000000         // in s.size: small block, class in low bits
+#define CHUNK 4096               // bytes to carve into small blocks at a time
+
+static Header *classfree[NCLASS];
+
+static void
+bigfree(void *ap)
 {
   Header *bp, *p;
 
@@ -51,17 +68,20 @@ morecore(uint nu)
 
   if(nu < 4096)
     nu = 4096;
+  // sbrk() takes an int; a bigger request would wrap.
+  if(nu > 0x7fffffff / sizeof(Header))
+    return 0;
   p = sbrk(nu * sizeof(Header));
   if(p == (char*)-1)
     return 0;
   hp = (Header*)p;
   hp->s.size = nu;
-  free((void*)(hp + 1));
+  bigfree((void*)(hp + 1));
   return freep;
 }
 
-void*
-malloc(uint nbytes)
+static void*
+bigmalloc(uint nbytes)
 {
   Header *p, *prevp;
   uint nunits;
@@ -88,3 +108,103 @@ malloc(uint nbytes)
         return 0;
   }
 }
+
+// Carve a chunk into blocks of class c.
+static int
+refill(int c)
+{
+  char *p;
+  Header *hp;
+  uint i, n, sz;
+
+  sz = CLASSSZ(c);
+  n = CHUNK / sz;
+  if((p = bigmalloc(n * sz)) == 0)
+    return -1;
+  for(i = 0; i < n; i++){
+    hp = (Header*)(p + i*sz);
+    hp->s.size = SMALL | c;
+    hp->s.ptr = classfree[c];
+    classfree[c] = hp;
+  }
+  return 0;
+}
+
+void*
+malloc(uint nbytes)
+{
+  Header *hp;
+  int c;
+
+  for(c = 0; c < NCLASS; c++){
+    if(nbytes + sizeof(Header) <= CLASSSZ(c))
+      break;
+  }
+  if(c == NCLASS)
+    return bigmalloc(nbytes);
+
+  if(classfree[c] == 0 && refill(c) < 0)
+    return 0;
+  hp = classfree[c];
+  classfree[c] = hp->s.ptr;
+  return (void*)(hp + 1);
+}
+
+void
+free(void *ap)
+{
+  Header *hp;
+  int c;
+
+  if(ap == 0)
+    return;
+  hp = (Header*)ap - 1;
+  if(hp->s.size & SMALL){
+    c = hp->s.size & ~SMALL;
+    hp->s.ptr = classfree[c];
+    classfree[c] = hp;
+  } else {
+    bigfree(ap);
+  }
+}
+
+// How many bytes the block at ap can hold.
+static uint
+blocksize(void *ap)
+{
+  Header *hp = (Header*)ap - 1;
+
+  if(hp->s.size & SMALL)
+    return CLASSSZ(hp->s.size & ~SMALL) - sizeof(Header);
+  return (hp->s.size - 1) * sizeof(Header);
+}
+
+void*
+calloc(uint n, uint size)
+{
+  void *p;
+
+  if(size != 0 && n > 0xffffffff / size)
+    return 0;
+  if((p = malloc(n * size)) != 0)
+    memset(p, 0, n * size);
+  return p;
+}
+
+void*
+realloc(void *ap, uint nbytes)
+{
+  void *p;
+  uint sz;
+
+  if(ap == 0)
+    return malloc(nbytes);
+  sz = blocksize(ap);
+  if(nbytes <= sz)
+    return ap;
+  if((p = malloc(nbytes)) == 0)
+    return 0;
+  memmove(p, ap, sz);
+  free(ap);
+  return p;
+}
@@ -1,8 +1,18 @@
 struct stat;
+struct kstat;
+
+// printf() buffering modes, for setvbuf().
+#define _IONBF 0  // unbuffered
+#define _IOLBF 1  // line buffered
+#define _IOFBF 2  // fully buffered
+#define BUFSIZ 512
 
 // system calls
 int fork(void);
 int exit(int) __attribute__((noreturn));
+int _fork(void);
+int _exit(int) __attribute__((noreturn));
+int _exec(const char*, char**);
 int wait(int*);
 int pipe(int*);
 int write(int, const void*, int);
@@ -22,6 +32,10 @@ int getpid(void);
 char* sbrk(int);
 int sleep(int);
 int uptime(void);
+int kstat(struct kstat*);
+void* mmap(void*, uint, int, int, int, uint);
+int munmap(void*, uint);
+int fsync(int);
 
 // ulib.c
 int stat(const char*, struct stat*);
@@ -31,10 +45,15 @@ char* strchr(const char*, char c);
 int strcmp(const char*, const char*);
 void fprintf(int, const char*, ...);
 void printf(const char*, ...);
+void fflush(int);
+void flushall(void);
+int setvbuf(int, int);
 char* gets(char*, int max);
 uint strlen(const char*);
 void* memset(void*, int, uint);
 void* malloc(uint);
+void* calloc(uint, uint);
+void* realloc(void*, uint);
 void free(void*);
 int atoi(const char*);
 int memcmp(const void *, const void *, uint);
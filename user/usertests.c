@@ -7,6 +7,7 @@
 #include "kernel/syscall.h"
 #include "kernel/memlayout.h"
 #include "kernel/riscv.h"
+#include "kernel/kstat.h"
 
 //
 // Tests xv6 system calls.  usertests without arguments runs them all
@@ -21,6 +22,8 @@
 
 char buf[BUFSZ];
 
+int countfree();
+
 //
 // Section with tests that run fairly quickly.  Use -q if you want to
 // run just those.  With -q usertests also runs the ones that take a
@@ -578,6 +581,8 @@ writetest(char *s)
 void
 writebig(char *s)
 {
+  // reach well into the double-indirect blocks.
+  enum { NBIG = NDIRECT + NINDIRECT + 4*NINDIRECT };
   int i, fd, n;
 
   fd = open("big", O_CREATE|O_RDWR);
@@ -586,7 +591,7 @@ writebig(char *s)
     exit(1);
   }
 
-  for(i = 0; i < MAXFILE; i++){
+  for(i = 0; i < NBIG; i++){
     ((int*)buf)[0] = i;
     if(write(fd, buf, BSIZE) != BSIZE){
       printf("%s: error: write big file failed\n", s, i);
@@ -606,7 +611,7 @@ writebig(char *s)
   for(;;){
     i = read(fd, buf, BSIZE);
     if(i == 0){
-      if(n == MAXFILE - 1){
+      if(n != NBIG){
         printf("%s: read only %d blocks from big", s, n);
         exit(1);
       }
@@ -629,6 +634,60 @@ writebig(char *s)
   }
 }
 
+// write a file of the largest size there is, in big writes,
+// and read it back.
+void
+hugefile(char *s)
+{
+  enum { N = BUFSZ / BSIZE };
+  int fd, i, j, n;
+
+  unlink("huge");
+  fd = open("huge", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create huge failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < MAXFILE; i += n){
+    n = MAXFILE - i < N ? MAXFILE - i : N;
+    for(j = 0; j < n; j++)
+      ((int*)buf)[j * BSIZE / sizeof(int)] = i + j;
+    if(write(fd, buf, n * BSIZE) != n * BSIZE){
+      printf("%s: write huge failed at block %d\n", s, i);
+      exit(1);
+    }
+  }
+  if(write(fd, buf, 1) != -1){
+    printf("%s: wrote past MAXFILE\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open("huge", O_RDONLY);
+  if(fd < 0){
+    printf("%s: open huge failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < MAXFILE; i += n){
+    n = MAXFILE - i < N ? MAXFILE - i : N;
+    if(read(fd, buf, n * BSIZE) != n * BSIZE){
+      printf("%s: read huge failed at block %d\n", s, i);
+      exit(1);
+    }
+    for(j = 0; j < n; j++){
+      if(((int*)buf)[j * BSIZE / sizeof(int)] != i + j){
+        printf("%s: wrong content in block %d\n", s, i + j);
+        exit(1);
+      }
+    }
+  }
+  close(fd);
+  if(unlink("huge") < 0){
+    printf("%s: unlink huge failed\n", s);
+    exit(1);
+  }
+}
+
 // many creates, followed by unlink test
 void
 createtest(char *s)
@@ -675,6 +734,71 @@ void dirtest(char *s)
   }
 }
 
+// names the directory name cache has seen, present or not,
+// must follow creates, links and unlinks.
+void
+dcachetest(char *s)
+{
+  int fd;
+
+  unlink("dcd/a");
+  unlink("dcd/b");
+  unlink("dcd");
+  if(open("dcd/a", O_RDONLY) >= 0 || open("dcd/a", O_RDONLY) >= 0){
+    printf("%s: opened nonexistent file\n", s);
+    exit(1);
+  }
+  if(mkdir("dcd") < 0){
+    printf("%s: mkdir failed\n", s);
+    exit(1);
+  }
+  if(open("dcd/a", O_RDONLY) >= 0){
+    printf("%s: opened nonexistent file\n", s);
+    exit(1);
+  }
+  fd = open("dcd/a", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if((fd = open("/dcd/../dcd/./a", O_RDONLY)) < 0){
+    printf("%s: created file not found\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(link("dcd/a", "dcd/b") < 0 || unlink("dcd/a") < 0){
+    printf("%s: link or unlink failed\n", s);
+    exit(1);
+  }
+  if(open("dcd/a", O_RDONLY) >= 0){
+    printf("%s: unlinked file still there\n", s);
+    exit(1);
+  }
+  if((fd = open("dcd/b", O_RDONLY)) < 0){
+    printf("%s: linked file not found\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(unlink("dcd/b") < 0 || unlink("dcd") < 0){
+    printf("%s: unlink failed\n", s);
+    exit(1);
+  }
+
+  // the directory's i-number may now be a file's.
+  fd = open("dcd", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(open("dcd/b", O_RDONLY) >= 0 || open("dcd/.", O_RDONLY) >= 0){
+    printf("%s: looked up a name in a file\n", s);
+    exit(1);
+  }
+  unlink("dcd");
+}
+
 void
 exectest(char *s)
 {
@@ -1086,6 +1210,36 @@ mem(char *s)
   }
 }
 
+// a request too big for sbrk() must fail cleanly,
+// leaving the heap usable.
+void
+mallochuge(char *s)
+{
+  char *p, *q;
+
+  p = malloc(100);
+  if(p == 0){
+    printf("%s: malloc failed\n", s);
+    exit(1);
+  }
+  strcpy(p, "hello");
+  if(malloc(0xf0000000) != 0){
+    printf("%s: huge malloc succeeded\n", s);
+    exit(1);
+  }
+  if((q = malloc(20000)) == 0){
+    printf("%s: malloc after huge malloc failed\n", s);
+    exit(1);
+  }
+  memset(q, 1, 20000);
+  if(strcmp(p, "hello") != 0){
+    printf("%s: heap damaged\n", s);
+    exit(1);
+  }
+  free(q);
+  free(p);
+}
+
 // More file system tests
 
 // two processes write to the same file descriptor
@@ -1778,6 +1932,442 @@ bigfile(char *s)
   unlink("bigfile.dat");
 }
 
+// sequential reads of a file, which the kernel reads
+// ahead, must still see the right data, as must a
+// second descriptor reading the same file out of step.
+// The file is bigger than the buffer cache, so its first
+// blocks are gone from the cache by the time they are read
+// back, and read-ahead should turn nearly every read of
+// them into a cache hit.
+void
+readahead(char *s)
+{
+  enum { N = 2*NBUF };
+  int fd, fd2, i;
+  struct kstat st0, st1;
+
+  unlink("readahead");
+  fd = open("readahead", O_CREATE | O_RDWR);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    memset(buf, i, BSIZE);
+    if(write(fd, buf, BSIZE) != BSIZE){
+      printf("%s: write failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+
+  if(kstat(&st0) < 0){
+    printf("%s: kstat failed\n", s);
+    exit(1);
+  }
+  fd = open("readahead", O_RDONLY);
+  if(fd < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    if(read(fd, buf, BSIZE) != BSIZE || buf[0] != (char)i || buf[BSIZE-1] != (char)i){
+      printf("%s: wrong data in block %d\n", s, i);
+      exit(1);
+    }
+  }
+  if(read(fd, buf, BSIZE) != 0){
+    printf("%s: read past end\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(kstat(&st1) < 0){
+    printf("%s: kstat failed\n", s);
+    exit(1);
+  }
+  if(st1.bahead <= st0.bahead){
+    printf("%s: nothing read ahead\n", s);
+    exit(1);
+  }
+  if(st1.bhit + st1.bmiss < st0.bhit + st0.bmiss + N){
+    printf("%s: bread counters did not advance\n", s);
+    exit(1);
+  }
+  if((st1.bmiss - st0.bmiss) * 4 > N){
+    printf("%s: %l misses reading %d blocks\n", s,
+           st1.bmiss - st0.bmiss, N);
+    exit(1);
+  }
+
+  fd = open("readahead", O_RDONLY);
+  fd2 = open("readahead", O_RDONLY);
+  if(fd < 0 || fd2 < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N; i++){
+    if(read(fd, buf, BSIZE) != BSIZE || buf[0] != (char)i || buf[BSIZE-1] != (char)i){
+      printf("%s: wrong data in block %d\n", s, i);
+      exit(1);
+    }
+    if(i % 3 == 0 && read(fd2, buf, 3*BSIZE/2) != 3*BSIZE/2){
+      printf("%s: second read failed\n", s);
+      exit(1);
+    }
+  }
+  close(fd);
+  close(fd2);
+  unlink("readahead");
+}
+
+// a multi-block write puts blocks next to each other in the
+// log and in the file, which the kernel should write with fewer
+// disk requests than blocks; the data must survive that.
+void
+clusterwrite(char *s)
+{
+  enum { N = 6 };
+  int fd, i;
+  struct kstat st0, st1;
+
+  unlink("clusterwrite");
+  if(kstat(&st0) < 0){
+    printf("%s: kstat failed\n", s);
+    exit(1);
+  }
+  fd = open("clusterwrite", O_CREATE | O_RDWR);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N*BSIZE; i++)
+    buf[i] = i / BSIZE + i % 7;
+  if(write(fd, buf, N*BSIZE) != N*BSIZE){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  if(kstat(&st1) < 0){
+    printf("%s: kstat failed\n", s);
+    exit(1);
+  }
+  if(st1.dblocks - st0.dblocks <= st1.dreq - st0.dreq){
+    printf("%s: %l requests for %l blocks\n", s,
+           st1.dreq - st0.dreq, st1.dblocks - st0.dblocks);
+    exit(1);
+  }
+
+  memset(buf, 0, N*BSIZE);
+  fd = open("clusterwrite", O_RDONLY);
+  if(fd < 0 || read(fd, buf, N*BSIZE) != N*BSIZE){
+    printf("%s: read failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  for(i = 0; i < N*BSIZE; i++){
+    if(buf[i] != (char)(i / BSIZE + i % 7)){
+      printf("%s: wrong data at %d\n", s, i);
+      exit(1);
+    }
+  }
+  unlink("clusterwrite");
+}
+
+// file data is written back from the buffer cache rather
+// than logged; fsync() must succeed on files, fail on
+// anything else, and the data must read back intact after
+// overwrites of old blocks and writes of new ones.
+void
+fsynctest(char *s)
+{
+  enum { N = 5 };
+  int fd, fds[2], i;
+
+  unlink("fsyncfile");
+  fd = open("fsyncfile", O_CREATE | O_RDWR);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < N*BSIZE; i++)
+    buf[i] = i % 251;
+  if(write(fd, buf, N*BSIZE) != N*BSIZE){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  if(fsync(fd) != 0){
+    printf("%s: fsync failed\n", s);
+    exit(1);
+  }
+
+  close(fd);
+
+  // overwrite the middle, across a block boundary.
+  fd = open("fsyncfile", O_RDWR);
+  if(fd < 0 || write(fd, buf, 2*BSIZE - BSIZE/2) != 2*BSIZE - BSIZE/2){
+    printf("%s: reopen failed\n", s);
+    exit(1);
+  }
+  memset(buf, 'x', BSIZE);
+  if(write(fd, buf, BSIZE) != BSIZE){
+    printf("%s: overwrite failed\n", s);
+    exit(1);
+  }
+  if(fsync(fd) != 0){
+    printf("%s: second fsync failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open("fsyncfile", O_RDONLY);
+  if(fd < 0 || read(fd, buf, N*BSIZE) != N*BSIZE){
+    printf("%s: read failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  for(i = 0; i < N*BSIZE; i++){
+    char c = (i >= 2*BSIZE - BSIZE/2 && i < 3*BSIZE - BSIZE/2) ? 'x' : i % 251;
+    if(buf[i] != c){
+      printf("%s: wrong data at %d\n", s, i);
+      exit(1);
+    }
+  }
+  unlink("fsyncfile");
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if(fsync(fds[0]) != -1 || fsync(-1) != -1 || fsync(NOFILE) != -1){
+    printf("%s: fsync of a non-file succeeded\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+}
+
+// this program is big enough that exec() pages it in on
+// demand, so its file can't be written while it runs.
+// Writes back the byte that is there, in case it can.
+void
+textbusy(char *s)
+{
+  int fd;
+  char c;
+
+  fd = open("usertests", O_RDWR);
+  if(fd < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  if(read(fd, &c, 1) != 1){
+    printf("%s: read failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  fd = open("usertests", O_RDWR);
+  if(fd < 0){
+    printf("%s: reopen failed\n", s);
+    exit(1);
+  }
+  if(write(fd, &c, 1) != -1){
+    printf("%s: wrote a running program\n", s);
+    exit(1);
+  }
+  close(fd);
+}
+
+// exec() of this program, which is big enough to be paged
+// in on demand, must fault in its text as it runs it and
+// exit normally.
+void
+execlazy(char *s)
+{
+  int pid, xstatus;
+  char *args[] = { "usertests", "-h", 0 };
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    close(1);
+    exec("usertests", args);
+    fprintf(2, "%s: exec failed\n", s);
+    exit(1);
+  }
+  wait(&xstatus);
+  if(xstatus != 0){
+    printf("%s: exited with status %d\n", s, xstatus);
+    exit(1);
+  }
+}
+
+// mmap() a file private and shared, across fork(),
+// and check what reaches the file.
+void
+mmaptest(char *s)
+{
+  enum { SZ = 2*4096 + 4096/2 };
+  int fd, fd2, i, pid, xstatus;
+  char *p, *q;
+
+  unlink("mmapfile");
+  fd = open("mmapfile", O_CREATE | O_RDWR);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < SZ; i++)
+    buf[i] = 'a' + i % 23;
+  if(write(fd, buf, SZ) != SZ){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+
+  p = mmap(0, SZ, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+  if(p == (char*)-1){
+    printf("%s: mmap private failed\n", s);
+    exit(1);
+  }
+  for(i = 0; i < SZ; i++){
+    if(p[i] != 'a' + i % 23){
+      printf("%s: wrong data at %d\n", s, i);
+      exit(1);
+    }
+  }
+  if(p[SZ] != 0 || p[3*4096-1] != 0){
+    printf("%s: no zeros past end of file\n", s);
+    exit(1);
+  }
+  p[0] = 'X';
+  if(munmap(p, SZ) < 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+
+  p = mmap(0, SZ, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  q = mmap(0, 4096, PROT_READ, MAP_SHARED, fd, 4096);
+  if(p == (char*)-1 || q == (char*)-1 || p == q){
+    printf("%s: mmap shared failed\n", s);
+    exit(1);
+  }
+  if(p[0] != 'a'){
+    printf("%s: private store reached the file\n", s);
+    exit(1);
+  }
+  p[4096] = 'Y';
+  if(q[0] != 'Y'){
+    printf("%s: mappings don't share pages\n", s);
+    exit(1);
+  }
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    p[1] = 'Z';
+    exit(q[0] == 'Y' ? 0 : 1);
+  }
+  wait(&xstatus);
+  if(xstatus != 0 || p[1] != 'Z'){
+    printf("%s: child's mapping isn't shared\n", s);
+    exit(1);
+  }
+
+  // read() into a page of the very file it reads.
+  fd2 = open("mmapfile", O_RDONLY);
+  if(fd2 < 0 || read(fd2, p + 2*4096, 8) != 8 || p[2*4096+1] != 'Z'){
+    printf("%s: read into mapping failed\n", s);
+    exit(1);
+  }
+  close(fd2);
+  if(munmap(p, SZ) < 0 || munmap(q, 4096) < 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  fd = open("mmapfile", O_RDONLY);
+  if(fd < 0 || read(fd, buf, SZ) != SZ){
+    printf("%s: reopen failed\n", s);
+    exit(1);
+  }
+  if(buf[0] != 'a' || buf[1] != 'Z' || buf[4096] != 'Y' || buf[4097] != 'a' + 4097 % 23 ||
+     buf[2*4096] != 'a' || buf[2*4096+1] != 'Z' || buf[2*4096+2] != 'a' + 2){
+    printf("%s: shared stores didn't reach the file\n", s);
+    exit(1);
+  }
+  if(mmap(0, 4096, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) != (char*)-1){
+    printf("%s: shared writable mapping of read-only file\n", s);
+    exit(1);
+  }
+  close(fd);
+  unlink("mmapfile");
+}
+
+// wait() and a pipe read() copy out while holding spinlocks;
+// they must still reach mmap() pages not yet touched.
+void
+mmapcopyout(char *s)
+{
+  int fd, fds[2], pid;
+  char *p;
+
+  unlink("mmapcopyout");
+  fd = open("mmapcopyout", O_CREATE | O_RDWR);
+  if(fd < 0){
+    printf("%s: create failed\n", s);
+    exit(1);
+  }
+  memset(buf, 0, 2*4096);
+  if(write(fd, buf, 2*4096) != 2*4096){
+    printf("%s: write failed\n", s);
+    exit(1);
+  }
+  p = mmap(0, 2*4096, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if(p == (char*)-1){
+    printf("%s: mmap failed\n", s);
+    exit(1);
+  }
+  close(fd);
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0)
+    exit(7);
+  if(wait((int*)(p + 4096 + 8)) != pid || *(int*)(p + 4096 + 8) != 7){
+    printf("%s: wait into a mapped page failed\n", s);
+    exit(1);
+  }
+
+  if(pipe(fds) != 0){
+    printf("%s: pipe failed\n", s);
+    exit(1);
+  }
+  if(write(fds[1], "hello", 5) != 5){
+    printf("%s: pipe write failed\n", s);
+    exit(1);
+  }
+  if(read(fds[0], p + 100, 5) != 5 || memcmp(p + 100, "hello", 5) != 0){
+    printf("%s: pipe read into a mapped page failed\n", s);
+    exit(1);
+  }
+  close(fds[0]);
+  close(fds[1]);
+
+  if(munmap(p, 2*4096) < 0){
+    printf("%s: munmap failed\n", s);
+    exit(1);
+  }
+  unlink("mmapcopyout");
+}
+
 void
 fourteen(char *s)
 {
@@ -1993,6 +2583,55 @@ forktest(char *s)
   }
 }
 
+// fork a process that uses more than half of the free
+// memory. this only works if fork() shares pages copy-on-write
+// instead of copying them.
+void
+cowfork(char *s)
+{
+  uint64 sz;
+  char *a, *p;
+  int pid, xstatus;
+
+  sz = (uint64)countfree() / 3 * 2 * PGSIZE;
+  a = sbrk(sz);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  for(p = a; p < a + sz; p += PGSIZE)
+    *(int*)p = getpid();
+
+  pid = fork();
+  if(pid < 0){
+    printf("%s: fork failed\n", s);
+    exit(1);
+  }
+  if(pid == 0){
+    int ppid = *(int*)a;
+    for(p = a; p < a + sz; p += PGSIZE){
+      if(*(int*)p != ppid){
+        printf("%s: child saw wrong value\n", s);
+        exit(1);
+      }
+    }
+    // the writes must not be visible to the parent.
+    *(int*)a = getpid();
+    *(int*)(a + sz - PGSIZE) = getpid();
+    exit(0);
+  }
+  wait(&xstatus);
+  if(xstatus != 0)
+    exit(xstatus);
+  for(p = a; p < a + sz; p += PGSIZE){
+    if(*(int*)p != getpid()){
+      printf("%s: parent memory changed\n", s);
+      exit(1);
+    }
+  }
+  sbrk(-sz);
+}
+
 void
 sbrkbasic(char *s)
 {
@@ -2117,6 +2756,50 @@ sbrkmuch(char *s)
   }
 }
 
+// sbrk() should not allocate memory until it is used,
+// and system calls should see untouched heap pages as zeroes.
+void
+sbrklazy(char *s)
+{
+  enum { BIG=64*1024*1024 };
+  int n0, n1, fd, i;
+  char *a;
+
+  n0 = countfree();
+  a = sbrk(BIG);
+  if(a == (char*)0xffffffffffffffffL){
+    printf("%s: sbrk failed\n", s);
+    exit(1);
+  }
+  a[0] = 1;
+  a[BIG/2] = 1;
+  a[BIG-1] = 1;
+  n1 = countfree();
+  if(n0 - n1 > 16){
+    printf("%s: sbrk used %d pages\n", s, n0 - n1);
+    exit(1);
+  }
+
+  fd = open("sbrklazy", O_CREATE|O_RDWR);
+  if(fd < 0){
+    printf("%s: open failed\n", s);
+    exit(1);
+  }
+  unlink("sbrklazy");
+  if(write(fd, a + 5*PGSIZE, PGSIZE) != PGSIZE){
+    printf("%s: write from untouched page failed\n", s);
+    exit(1);
+  }
+  close(fd);
+  for(i = 0; i < PGSIZE; i++){
+    if(a[5*PGSIZE + i] != 0){
+      printf("%s: untouched page not zero\n", s);
+      exit(1);
+    }
+  }
+  sbrk(-BIG);
+}
+
 // can we read the kernel's memory?
 void
 kernmem(char *s)
@@ -2592,6 +3275,7 @@ struct test {
   {writebig, "writebig"},
   {createtest, "createtest"},
   {dirtest, "dirtest"},
+  {dcachetest, "dcachetest"},
   {exectest, "exectest"},
   {pipe1, "pipe1"},
   {killstatus, "killstatus"},
@@ -2603,6 +3287,7 @@ struct test {
   {forkforkfork, "forkforkfork"},
   {reparent2, "reparent2"},
   {mem, "mem"},
+  {mallochuge, "mallochuge"},
   {sharedfd, "sharedfd"},
   {fourfiles, "fourfiles"},
   {createdelete, "createdelete"},
@@ -2613,13 +3298,22 @@ struct test {
   {subdir, "subdir"},
   {bigwrite, "bigwrite"},
   {bigfile, "bigfile"},
+  {readahead, "readahead"},
+  {clusterwrite, "clusterwrite"},
+  {fsynctest, "fsynctest"},
+  {textbusy, "textbusy"},
+  {execlazy, "execlazy"},
+  {mmaptest, "mmaptest"},
+  {mmapcopyout, "mmapcopyout"},
   {fourteen, "fourteen"},
   {rmdot, "rmdot"},
   {dirfile, "dirfile"},
   {iref, "iref"},
   {forktest, "forktest"},
+  {cowfork, "cowfork"},
   {sbrkbasic, "sbrkbasic"},
   {sbrkmuch, "sbrkmuch"},
+  {sbrklazy, "sbrklazy"},
   {kernmem, "kernmem"},
   {MAXVAplus, "MAXVAplus"},
   {sbrkfail, "sbrkfail"},
@@ -2929,6 +3623,7 @@ struct test slowtests[] = {
   {manywrites, "manywrites"},
   {badwrite, "badwrite" },
   {execout, "execout"},
+  {hugefile, "hugefile"},
   {diskfull, "diskfull"},
   {outofinodes, "outofinodes"},
     
@@ -3004,6 +3699,9 @@ countfree()
   if(pid == 0){
     close(fds[0]);
     
+    // sbrk() allocates lazily and rarely fails, so the
+    // child usually ends when the kernel kills it for
+    // touching a page there is no memory left for.
     while(1){
       uint64 a = (uint64) sbrk(4096);
       if(a == 0xffffffffffffffff){
@@ -3081,7 +3779,10 @@ main(int argc, char *argv[])
   int quick = 0;
   char *justone = 0;
 
-  if(argc == 2 && strcmp(argv[1], "-q") == 0){
+  if(argc == 2 && strcmp(argv[1], "-h") == 0){
+    printf("Usage: usertests [-c] [-C] [-q] [testname]\n");
+    exit(0);
+  } else if(argc == 2 && strcmp(argv[1], "-q") == 0){
     quick = 1;
   } else if(argc == 2 && strcmp(argv[1], "-c") == 0){
     continuous = 1;